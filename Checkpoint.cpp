@@ -16,14 +16,21 @@
 
 #define LOG_TAG "Checkpoint"
 #include "Checkpoint.h"
+#include "Crc32.h"
 #include "FsCrypt.h"
 #include "KeyStorage.h"
 #include "VoldUtil.h"
 #include "VolumeManager.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
@@ -33,6 +40,7 @@
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/properties.h>
+#include <android-base/scopeguard.h>
 #include <android-base/unique_fd.h>
 #include <cutils/android_reboot.h>
 #include <fcntl.h>
@@ -42,6 +50,7 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 using android::base::GetBoolProperty;
@@ -159,6 +168,9 @@ volatile bool needsCheckpointWasCalled = false;
 // Protects isCheckpointing, needsCheckpointWasCalled and code that makes decisions based on status
 // of isCheckpointing
 std::mutex isCheckpointingLock;
+
+std::mutex metricsLock;
+CheckpointMetrics metrics;
 }
 
 Status cp_commitChanges() {
@@ -172,6 +184,12 @@ Status cp_commitChanges() {
             << "NOT COMMITTING CHECKPOINT BECAUSE persist.vold.dont_commit_checkpoint IS 1";
         return Status::ok();
     }
+    auto start = std::chrono::steady_clock::now();
+    auto record_time = android::base::make_scope_guard([start] {
+        std::lock_guard<std::mutex> lock(metricsLock);
+        metrics.commit_time += std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start);
+    });
     auto module = BootControlClient::WaitForService();
     if (module) {
         auto cr = module->MarkBootSuccessful();
@@ -314,30 +332,108 @@ const std::string kSleepTimeProp = "ro.sys.cp_msleeptime";
 const uint32_t msleeptime_default = 1000;  // 1 s
 const uint32_t max_msleeptime = 3600000;   // 1 h
 
+// While free space isn't going down, polling backs off up to this.
+const std::string kIdleSleepTimeProp = "ro.sys.cp_idle_msleeptime";
+const uint32_t idle_msleeptime_default = 30000;  // 30 s
+
+// As free space is about to run out, polling speeds up to this.
+const uint32_t min_msleeptime = 100;  // 100 ms
+
 const std::string kMinFreeBytesProp = "ro.sys.cp_min_free_bytes";
 const uint64_t min_free_bytes_default = 100 * (1 << 20);  // 100 MiB
 
+// How long before free space is projected to drop below the minimum to stop
+// checkpointing, leaving time for the commit itself.
+const std::string kLeadTimeProp = "ro.sys.cp_lead_msec";
+const uint32_t lead_msec_default = 5000;  // 5 s
+
 const std::string kCommitOnFullProp = "ro.sys.cp_commit_on_full";
 const bool commit_on_full_default = true;
 
+// Free space is assumed not to go down faster than this, which bounds how long
+// polling can back off for without missing the minimum.
+const uint64_t kMaxBurnRate = 2ULL << 30;  // 2 GiB/s
+
+// Estimates how fast free space is being used from the samples over a sliding
+// window, and projects when it will drop below the minimum.
+class FreeSpaceMonitor {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit FreeSpaceMonitor(uint64_t min_free_bytes) : min_free_bytes_(min_free_bytes) {}
+
+    void addSample(Clock::time_point time, uint64_t free_bytes) {
+        samples_.push_back({time, free_bytes});
+        // Keep one sample from before the window, so that it's always covered
+        // even when polling is slower than the window.
+        while (samples_.size() > 2 && time - samples_[1].time >= kWindow) samples_.pop_front();
+    }
+
+    // In bytes per second.  Zero if free space isn't going down.
+    double burnRate() const {
+        if (samples_.size() < 2) return 0;
+        const Sample& first = samples_.front();
+        const Sample& last = samples_.back();
+        if (last.free_bytes >= first.free_bytes) return 0;
+        double seconds = std::chrono::duration<double>(last.time - first.time).count();
+        if (seconds <= 0) return 0;
+        return (first.free_bytes - last.free_bytes) / seconds;
+    }
+
+    // Free space above the minimum.
+    uint64_t headroom() const {
+        uint64_t free_bytes = samples_.empty() ? 0 : samples_.back().free_bytes;
+        return free_bytes > min_free_bytes_ ? free_bytes - min_free_bytes_ : 0;
+    }
+
+    // How long until free space drops below the minimum at the current rate.
+    std::chrono::milliseconds timeLeft() const {
+        double rate = burnRate();
+        if (rate == 0) return std::chrono::milliseconds::max();
+        double ms = headroom() * 1000.0 / rate;
+        if (ms >= static_cast<double>(std::chrono::milliseconds::max().count())) {
+            return std::chrono::milliseconds::max();
+        }
+        return std::chrono::milliseconds(static_cast<int64_t>(ms));
+    }
+
+  private:
+    static constexpr std::chrono::seconds kWindow{30};
+
+    struct Sample {
+        Clock::time_point time;
+        uint64_t free_bytes;
+    };
+    uint64_t min_free_bytes_;
+    std::deque<Sample> samples_;
+};
+
 static void cp_healthDaemon(std::string mnt_pnt, std::string blk_device, bool is_fs_cp) {
+    using std::chrono::milliseconds;
+
     struct statvfs data;
-    uint32_t msleeptime = GetUintProperty(kSleepTimeProp, msleeptime_default, max_msleeptime);
+    milliseconds base_sleep(GetUintProperty(kSleepTimeProp, msleeptime_default, max_msleeptime));
+    milliseconds idle_sleep(
+            GetUintProperty(kIdleSleepTimeProp, idle_msleeptime_default, max_msleeptime));
     uint64_t min_free_bytes =
         GetUintProperty(kMinFreeBytesProp, min_free_bytes_default, (uint64_t)-1);
+    milliseconds lead_time(GetUintProperty(kLeadTimeProp, lead_msec_default, max_msleeptime));
     bool commit_on_full = GetBoolProperty(kCommitOnFullProp, commit_on_full_default);
+    idle_sleep = std::max(idle_sleep, base_sleep);
+    milliseconds min_sleep = std::min(milliseconds(min_msleeptime), base_sleep);
 
-    struct timespec req;
-    req.tv_sec = msleeptime / 1000;
-    msleeptime %= 1000;
-    req.tv_nsec = msleeptime * 1000000;
+    FreeSpaceMonitor monitor(min_free_bytes);
+    std::string bow_device;
+    std::optional<uint64_t> initial_free_bytes;
+    milliseconds sleep = base_sleep;
     while (isCheckpointing) {
         uint64_t free_bytes = 0;
         if (is_fs_cp) {
-            statvfs(mnt_pnt.c_str(), &data);
-            free_bytes = ((uint64_t) data.f_bavail) * data.f_frsize;
+            if (statvfs(mnt_pnt.c_str(), &data) == 0) {
+                free_bytes = ((uint64_t) data.f_bavail) * data.f_frsize;
+            }
         } else {
-            std::string bow_device = fs_mgr_find_bow_device(blk_device);
+            if (bow_device.empty()) bow_device = fs_mgr_find_bow_device(blk_device);
             if (!bow_device.empty()) {
                 std::string content;
                 if (android::base::ReadFileToString(bow_device + "/bow/free", &content)) {
@@ -345,7 +441,20 @@ static void cp_healthDaemon(std::string mnt_pnt, std::string blk_device, bool is
                 }
             }
         }
-        if (free_bytes < min_free_bytes) {
+        monitor.addSample(FreeSpaceMonitor::Clock::now(), free_bytes);
+        if (!initial_free_bytes) initial_free_bytes = free_bytes;
+        if (initial_free_bytes > free_bytes) {
+            std::lock_guard<std::mutex> lock(metricsLock);
+            metrics.peak_space_used = std::max(metrics.peak_space_used,
+                                               *initial_free_bytes - free_bytes);
+        }
+
+        milliseconds time_left = monitor.timeLeft();
+        if (free_bytes < min_free_bytes || time_left <= lead_time) {
+            if (free_bytes >= min_free_bytes) {
+                LOG(INFO) << "Space for checkpointing projected to run out in "
+                          << time_left.count() << "ms";
+            }
             if (commit_on_full) {
                 LOG(INFO) << "Low space for checkpointing. Commiting changes";
                 cp_commitChanges();
@@ -356,7 +465,20 @@ static void cp_healthDaemon(std::string mnt_pnt, std::string blk_device, bool is
                 break;
             }
         }
-        nanosleep(&req, NULL);
+
+        // Don't sleep for so long that the fastest writes could use up what's
+        // left in the meantime.
+        milliseconds safe_sleep(monitor.headroom() * 1000 / kMaxBurnRate);
+        milliseconds max_sleep = std::clamp(safe_sleep, base_sleep, idle_sleep);
+        if (monitor.burnRate() > 0) {
+            // Poll a few more times before it's time to stop, more often as
+            // that gets closer.
+            sleep = std::clamp((time_left - lead_time) / 4, min_sleep, max_sleep);
+        } else {
+            // Nothing is being written, so back off.
+            sleep = std::clamp(sleep * 2, min_sleep, max_sleep);
+        }
+        std::this_thread::sleep_for(sleep);
     }
 }
 
@@ -437,90 +559,161 @@ const int kMagic = 0x00574f42;
 // Partially restored MAGIC is WOB in ascii
 const int kPartialRestoreMagic = 0x00424f57;
 
-void crc32(const void* data, size_t n_bytes, uint32_t* crc) {
-    static uint32_t table[0x100] = {
-        0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
-        0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
-        0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
-        0x6DDDE4EB, 0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
-        0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4,
-        0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
-        0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC,
-        0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-        0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB,
-        0xB6662D3D,
-
-        0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5,
-        0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
-        0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED,
-        0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
-        0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE, 0xA3BC0074,
-        0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC,
-        0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C,
-        0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-        0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B,
-        0xC0BA6CAD,
-
-        0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615,
-        0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D,
-        0x0A00AE27, 0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D,
-        0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
-        0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4,
-        0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B, 0xD80D2BDA, 0xAF0A1B4C,
-        0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79, 0xCB61B38C,
-        0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-        0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B,
-        0x5BDEAE1D,
-
-        0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785,
-        0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D,
-        0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD,
-        0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
-        0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354,
-        0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
-        0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C,
-        0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-        0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B,
-        0x2D02EF8D};
-
-    for (size_t i = 0; i < n_bytes; ++i) {
-        *crc ^= ((uint8_t*)data)[i];
-        *crc = table[(uint8_t)*crc] ^ *crc >> 8;
-    }
-}
-
 // A map of relocations.
-// The map must be initialized so that relocations[0] = 0
 // During restore, we replay the log records in reverse, copying from dest to
 // source
 // To validate, we must be able to read the 'dest' sectors as though they had
 // been copied but without actually copying. This map represents how the sectors
-// would have been moved. To read a sector s, find the index <= s and read
-// relocations[index] + s - index
-typedef std::map<sector_t, sector_t> Relocations;
-
-void relocate(Relocations& relocations, sector_t dest, sector_t source, int count) {
-    // Find first one we're equal to or greater than
-    auto s = --relocations.upper_bound(source);
-
-    // Take slice
-    Relocations slice;
-    slice[dest] = source - s->first + s->second;
-    ++s;
+// would have been moved. It is a sorted list of extents, each mapping the
+// sectors from its start up to the next extent's start, so to read a sector s,
+// find the extent with the greatest start <= s and read target + s - start.
+// There is always an extent starting at 0.
+//
+// Big logs have hundreds of thousands of entries, so the extents are kept in
+// chunks of sorted vectors rather than one node per extent.  Each relocation
+// replaces a range of extents in bulk, and extents that continue the previous
+// one are merged into it.
+class Relocations {
+  public:
+    Relocations() : chunks_{{{0, 0}}} {}
+
+    // Makes the sectors [dest, dest + count) read as [source, source + count)
+    // currently do.
+    void relocate(sector_t dest, sector_t source, sector_t count);
+
+    // Calls fn(offset, target, n) for each run of sectors in [sector, sector +
+    // count) that are contiguous after relocation, where the run starts |offset|
+    // sectors into the range, is |n| sectors long and is at |target|.  Stops
+    // early if fn returns false, and returns whether it got to the end.
+    template <typename Fn>
+    bool forEachRun(sector_t sector, sector_t count, Fn fn) const;
+
+  private:
+    struct Extent {
+        sector_t start;
+        sector_t target;
+    };
+    // Chunks are split when they reach twice this many extents.
+    static constexpr size_t kChunkSize = 256;
+
+    static bool continues(const Extent& prev, const Extent& e) {
+        return e.target - prev.target == e.start - prev.start;
+    }
+    static bool startsAfter(sector_t sector, const Extent& e) { return sector < e.start; }
+
+    // Returns the index of the chunk holding the extent that maps |sector|.
+    size_t findChunk(sector_t sector) const {
+        auto it = std::upper_bound(chunks_.begin(), chunks_.end(), sector,
+                                   [](sector_t s, const std::vector<Extent>& chunk) {
+                                       return s < chunk.front().start;
+                                   });
+        return it - chunks_.begin() - 1;
+    }
+    // Returns the index of the extent that maps |sector| within chunk |ci|.
+    size_t findExtent(size_t ci, sector_t sector) const {
+        auto& chunk = chunks_[ci];
+        return std::upper_bound(chunk.begin(), chunk.end(), sector, startsAfter) - chunk.begin() -
+               1;
+    }
+    sector_t map(sector_t sector) const {
+        size_t ci = findChunk(sector);
+        const Extent& e = chunks_[ci][findExtent(ci, sector)];
+        return e.target + sector - e.start;
+    }
+    void appendMerged(const Extent& e) {
+        if (slice_.empty() || !continues(slice_.back(), e)) slice_.push_back(e);
+    }
 
-    // Add rest of elements
-    for (; s != relocations.end() && s->first < source + count; ++s)
-        slice[dest - source + s->first] = s->second;
+    std::vector<std::vector<Extent>> chunks_;
+    // Scratch space for relocate(), kept to avoid reallocating it every time.
+    std::vector<Extent> slice_;
+};
+
+void Relocations::relocate(sector_t dest, sector_t source, sector_t count) {
+    // Take slice of the current mapping of [source, source + count), moved to
+    // dest, followed by the current mapping of dest + count onwards.
+    slice_.clear();
+    size_t ci = findChunk(source);
+    size_t i = findExtent(ci, source);
+    const Extent* e = &chunks_[ci][i];
+    appendMerged({dest, e->target + source - e->start});
+    for (;;) {
+        if (++i == chunks_[ci].size()) {
+            if (++ci == chunks_.size()) break;
+            i = 0;
+        }
+        e = &chunks_[ci][i];
+        if (e->start >= source + count) break;
+        appendMerged({dest + e->start - source, e->target});
+    }
+    appendMerged({dest + count, map(dest + count)});
+
+    // Remove all extents in [dest, dest + count].
+    ci = findChunk(dest);
+    auto& chunk = chunks_[ci];
+    auto first = std::lower_bound(chunk.begin(), chunk.end(), dest,
+                                  [](const Extent& e, sector_t s) { return e.start < s; });
+    auto last = std::upper_bound(first, chunk.end(), dest + count, startsAfter);
+    size_t pos = chunk.erase(first, last) - chunk.begin();
+    while (ci + 1 < chunks_.size()) {
+        auto& next = chunks_[ci + 1];
+        next.erase(next.begin(), std::upper_bound(next.begin(), next.end(), dest + count,
+                                                  startsAfter));
+        if (!next.empty()) break;
+        chunks_.erase(chunks_.begin() + ci + 1);
+    }
 
-    // Split range at end of dest
-    auto dest_end = --relocations.upper_bound(dest + count);
-    relocations[dest + count] = dest + count - dest_end->first + dest_end->second;
+    // Merge the slice with the extents either side of it.
+    const Extent* prev = nullptr;
+    if (pos > 0)
+        prev = &chunk[pos - 1];
+    else if (ci > 0)
+        prev = &chunks_[ci - 1].back();
+    auto slice_begin = slice_.begin();
+    if (prev && continues(*prev, *slice_begin)) ++slice_begin;
+    if (pos < chunk.size()) {
+        if (continues(slice_.back(), chunk[pos])) chunk.erase(chunk.begin() + pos);
+    } else if (ci + 1 < chunks_.size()) {
+        auto& next = chunks_[ci + 1];
+        if (continues(slice_.back(), next.front())) {
+            next.erase(next.begin());
+            if (next.empty()) chunks_.erase(chunks_.begin() + ci + 1);
+        }
+    }
 
-    // Remove all elements in [dest, dest + count)
-    relocations.erase(relocations.lower_bound(dest), relocations.lower_bound(dest + count));
+    // Add new elements, splitting the chunk if it got too big.
+    chunk.insert(chunk.begin() + pos, slice_begin, slice_.end());
+    if (chunk.empty()) {
+        chunks_.erase(chunks_.begin() + ci);
+    } else if (chunk.size() >= 2 * kChunkSize) {
+        std::vector<std::vector<Extent>> pieces;
+        for (size_t i = kChunkSize; i < chunk.size(); i += kChunkSize)
+            pieces.emplace_back(chunk.begin() + i,
+                                chunk.begin() + std::min(i + kChunkSize, chunk.size()));
+        chunk.resize(kChunkSize);
+        chunks_.insert(chunks_.begin() + ci + 1, std::make_move_iterator(pieces.begin()),
+                       std::make_move_iterator(pieces.end()));
+    }
+}
 
-    // Add new elements
-    relocations.insert(slice.begin(), slice.end());
+template <typename Fn>
+bool Relocations::forEachRun(sector_t sector, sector_t count, Fn fn) const {
+    size_t ci = findChunk(sector);
+    size_t i = findExtent(ci, sector);
+    for (sector_t offset = 0; offset < count;) {
+        const Extent& e = chunks_[ci][i];
+        if (++i == chunks_[ci].size()) {
+            ci++;
+            i = 0;
+        }
+        // The run ends where the next extent starts, if that's within range.
+        sector_t s = sector + offset;
+        sector_t n = count - offset;
+        if (ci < chunks_.size()) n = std::min(n, chunks_[ci][i].start - s);
+        if (!fn(offset, e.target + s - e.start, n)) return false;
+        offset += n;
+    }
+    return true;
 }
 
 // A map of sectors that have been written to.
@@ -560,27 +753,127 @@ void markUsed(Used_Sectors& used_sectors, sector_t start, sector_t end) {
     }
 }
 
-// Restores the given log_entry's data from dest -> source
+// Writes restored log entries back to the device.  Entries whose sources are
+// adjacent are merged into a single pwritev(), so they're only guaranteed to
+// have been written after flush().  The buffers the entries are read into are
+// reused, rather than allocating one per entry.
+class RestoreWriter {
+  public:
+    explicit RestoreWriter(int device_fd) : device_fd_(device_fd) {}
+
+    // The buffer to read the next entry into, before passing it to queue().
+    std::vector<char>& nextBuffer() {
+        if (buffers_.size() == iov_.size()) buffers_.emplace_back();
+        return buffers_[iov_.size()];
+    }
+
+    // Returns whether a queued write overlaps [start, end).
+    bool overlaps(sector_t start, sector_t end) const {
+        return !iov_.empty() && start < end_ && start_ < end;
+    }
+
+    // Queues nextBuffer() to be written at |sector|.
+    bool queue(sector_t sector) {
+        size_t n = iov_.size();
+        size_t size = buffers_[n].size();
+        sector_t end = sector + (size - 1) / kSectorSize + 1;
+        bool adjacent = size % kSectorSize == 0 && bytes_ % kSectorSize == 0 &&
+                        (sector == end_ || end == start_);
+        if (n > 0 && (!adjacent || n == kMaxIovecs || bytes_ + size > kMaxWriteBytes)) {
+            if (!flush()) return false;
+            n = 0;
+        }
+
+        iovec iov = {buffers_[n].data(), size};
+        if (iov_.empty() || sector == end_) {
+            if (iov_.empty()) start_ = sector;
+            iov_.push_back(iov);
+            end_ = end;
+        } else {
+            iov_.insert(iov_.begin(), iov);
+            start_ = sector;
+        }
+        bytes_ += iov.iov_len;
+        return true;
+    }
+
+    // Writes all the queued entries.  nextBuffer() keeps its contents.
+    bool flush() {
+        if (iov_.empty()) return true;
+        ssize_t written = pwritev64(device_fd_, iov_.data(), iov_.size(), start_ * kSectorSize);
+        // The queued buffers start from the beginning again.
+        if (buffers_.size() > iov_.size()) std::swap(buffers_[0], buffers_[iov_.size()]);
+        iov_.clear();
+        dirty_ = true;
+        if (written != static_cast<ssize_t>(bytes_)) {
+            PLOG(ERROR) << "Failed to write restored sectors at " << start_;
+            bytes_ = 0;
+            return false;
+        }
+        bytes_ = 0;
+        return true;
+    }
+
+    // Writes all the queued entries and makes them durable.  Skips the fsync
+    // if nothing has been written since the last one.
+    bool sync() {
+        if (!flush()) return false;
+        if (!dirty_) return true;
+        dirty_ = false;
+        if (fsync(device_fd_) != 0) {
+            PLOG(ERROR) << "Failed to sync restored sectors";
+            return false;
+        }
+        return true;
+    }
+
+    // Writes |data| directly, e.g. to update a log sector, after the queued
+    // entries.
+    bool write(const void* data, size_t size, off64_t offset) {
+        if (!flush()) return false;
+        dirty_ = true;
+        return pwrite64(device_fd_, data, size, offset) == static_cast<ssize_t>(size);
+    }
+
+  private:
+    // Large enough that merging saves most of the syscalls, small enough that
+    // the buffers don't take much memory.
+    static constexpr size_t kMaxIovecs = 256;
+    static constexpr size_t kMaxWriteBytes = 1024 * 1024;
+
+    int device_fd_;
+    // The queued entries cover [start_, end_).
+    sector_t start_ = 0;
+    sector_t end_ = 0;
+    std::vector<iovec> iov_;
+    size_t bytes_ = 0;
+    bool dirty_ = false;
+    // The first iov_.size() of these are queued.  A deque so that references
+    // to them stay valid as more are added.
+    std::deque<std::vector<char>> buffers_;
+};
+
+// Restores the given log_entry's data from dest -> source.  The data must have
+// been read into writer.nextBuffer(), which may be flushed first.
 // If that entry is a log sector, set the magic to kPartialRestoreMagic and flush.
-void restoreSector(int device_fd, Used_Sectors& used_sectors, std::vector<char>& ls_buffer,
-                   log_entry* le, std::vector<char>& buffer) {
+bool restoreSector(RestoreWriter& writer, Used_Sectors& used_sectors,
+                   std::vector<char>& ls_buffer, log_entry* le) {
     log_sector_v1_0& ls = *reinterpret_cast<log_sector_v1_0*>(&ls_buffer[0]);
     uint32_t index = le - ((log_entry*)&ls_buffer[ls.header_size]);
     int count = (le->size - 1) / kSectorSize + 1;
 
     if (checkCollision(used_sectors, le->source, le->source + count)) {
-        fsync(device_fd);
-        lseek64(device_fd, 0, SEEK_SET);
+        if (!writer.sync()) return false;
         ls.count = index + 1;
         ls.magic = kPartialRestoreMagic;
-        write(device_fd, &ls_buffer[0], ls.block_size);
-        fsync(device_fd);
+        if (!writer.write(&ls_buffer[0], ls.block_size, 0) || !writer.sync()) return false;
         used_sectors.clear();
         used_sectors[0] = false;
     }
 
     markUsed(used_sectors, le->dest, le->dest + count);
 
+    std::vector<char>& buffer = writer.nextBuffer();
     if (index == 0 && ls.sequence != 0) {
         log_sector_v1_0* next = reinterpret_cast<log_sector_v1_0*>(&buffer[0]);
         if (next->magic == kMagic) {
@@ -588,45 +881,207 @@ void restoreSector(int device_fd, Used_Sectors& used_sectors, std::vector<char>&
         }
     }
 
-    lseek64(device_fd, le->source * kSectorSize, SEEK_SET);
-    write(device_fd, &buffer[0], le->size);
+    if (!writer.queue(le->source)) return false;
 
     if (index == 0) {
-        fsync(device_fd);
+        return writer.sync();
     }
+    return true;
 }
 
-// Read from the device
+// Read from the device into |buffer|
 // If we are validating, the read occurs as though the relocations had happened
-// returns the amount asked for or an empty buffer on error. Partial reads are considered a failure
-std::vector<char> relocatedRead(int device_fd, Relocations const& relocations, bool validating,
-                                sector_t sector, uint32_t size, uint32_t block_size) {
+// returns false on error. Partial reads are considered a failure
+bool relocatedRead(int device_fd, Relocations const& relocations, bool validating, sector_t sector,
+                   uint32_t size, std::vector<char>* buffer) {
+    buffer->resize(size);
     if (!validating) {
-        std::vector<char> buffer(size);
-        off64_t offset = sector * kSectorSize;
-        if (lseek64(device_fd, offset, SEEK_SET) != offset) {
-            return std::vector<char>();
+        return pread64(device_fd, buffer->data(), size, sector * kSectorSize) ==
+               static_cast<ssize_t>(size);
+    }
+
+    // Read each run of sectors that are still contiguous after relocation at once.
+    sector_t count = (size - 1) / kSectorSize + 1;
+    return relocations.forEachRun(
+            sector, count, [&](sector_t run_offset, sector_t target, sector_t run_count) {
+                size_t i = run_offset * kSectorSize;
+                size_t len = std::min<size_t>(run_count * kSectorSize, size - i);
+                return pread64(device_fd, &(*buffer)[i], len, target * kSectorSize) ==
+                       static_cast<ssize_t>(len);
+            });
+}
+
+// Checks the log entries' checksums during validation.  Validation never
+// writes, so once the caller has resolved where an entry's data is, reading
+// and checksumming it can go on in other threads while the caller moves on to
+// the next entry.  Whatever order they complete in, the first failure in log
+// order is the one reported.
+class Validator {
+  public:
+    Validator(int device_fd, uint32_t block_size) : device_fd_(device_fd), block_size_(block_size) {
+        // With a single core, handing the entries over costs more than it saves.
+        unsigned int num_threads = std::min(std::thread::hardware_concurrency(), kMaxThreads);
+        if (num_threads < 2) return;
+        for (unsigned int i = 0; i < num_threads; i++) {
+            threads_.emplace_back(&Validator::work, this);
+        }
+    }
+    ~Validator() { finish(Status::ok()); }
+
+    // Queues |le| to be checked as though |relocations| had happened.  Returns
+    // false once an earlier entry has failed, in which case the caller can
+    // stop and call finish().
+    bool check(Relocations const& relocations, const log_entry& le) {
+        uint32_t seed = le.source / (block_size_ / kSectorSize);
+        Job job = {next_index_++, le.size, seed, le.checksum, {}};
+        sector_t count = (le.size - 1) / kSectorSize + 1;
+        relocations.forEachRun(le.dest, count,
+                               [&](sector_t run_offset, sector_t target, sector_t run_count) {
+                                   job.runs.push_back({run_offset, target, run_count});
+                                   return true;
+                               });
+
+        if (threads_.empty()) {
+            if (const char* failure = verify(job, &buffer_)) {
+                failed_index_ = job.index;
+                failure_ = failure;
+                return false;
+            }
+            return true;
         }
-        if (read(device_fd, &buffer[0], size) != static_cast<ssize_t>(size)) {
-            return std::vector<char>();
+
+        // Start reading it before a thread is free.
+        for (const auto& run : job.runs) {
+            posix_fadvise(device_fd_, run.target * kSectorSize, run.count * kSectorSize,
+                          POSIX_FADV_WILLNEED);
         }
-        return buffer;
+        batch_.push_back(std::move(job));
+        return batch_.size() < kBatchSize || submit();
     }
 
-    std::vector<char> buffer(size);
-    for (uint32_t i = 0; i < size; i += block_size, sector += block_size / kSectorSize) {
-        auto relocation = --relocations.upper_bound(sector);
-        off64_t offset = (sector + relocation->second - relocation->first) * kSectorSize;
-        if (lseek64(device_fd, offset, SEEK_SET) != offset) {
-            return std::vector<char>();
+    // Waits for the queued entries, and returns the first one that failed, or
+    // else |status|, the caller's result for what came after them.
+    Status finish(Status status) {
+        if (!threads_.empty()) {
+            submit();
+            {
+                std::lock_guard<std::mutex> lock(lock_);
+                done_ = true;
+            }
+            queue_ready_.notify_all();
+            for (auto& thread : threads_) thread.join();
+            threads_.clear();
         }
-        if (read(device_fd, &buffer[i], block_size) != static_cast<ssize_t>(block_size)) {
-            return std::vector<char>();
+        if (!failed() || reported_) return status;
+        reported_ = true;
+        return error(EINVAL, failure_);
+    }
+
+  private:
+    struct Run {
+        sector_t offset;
+        sector_t target;
+        sector_t count;
+    };
+    struct Job {
+        uint64_t index;
+        uint32_t size;
+        uint32_t seed;
+        uint32_t checksum;
+        std::vector<Run> runs;
+    };
+
+    // The checksums are cheap next to the reads, so a few threads are enough
+    // to keep the device busy.  Entries are handed over in batches so that
+    // the locking doesn't cost more than checking small entries.
+    static constexpr unsigned int kMaxThreads = 4;
+    static constexpr size_t kBatchSize = 32;
+    static constexpr size_t kMaxQueued = 16;
+
+    bool failed() const { return failed_index_ != UINT64_MAX; }
+
+    // Queues batch_ for the threads.  Returns false if an entry has failed.
+    bool submit() {
+        std::unique_lock<std::mutex> lock(lock_);
+        queue_space_.wait(lock, [&] { return queue_.size() < kMaxQueued || failed(); });
+        if (failed()) return false;
+        if (batch_.empty()) return true;
+        queue_.push_back(std::move(batch_));
+        batch_.clear();
+        queue_ready_.notify_one();
+        return true;
+    }
+
+    void work() {
+        std::vector<char> buffer;
+        std::unique_lock<std::mutex> lock(lock_);
+        for (;;) {
+            queue_ready_.wait(lock, [&] { return done_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+            std::vector<Job> batch = std::move(queue_.front());
+            queue_.pop_front();
+            queue_space_.notify_one();
+
+            // Entries after a failure can't change the result.
+            uint64_t failed_index = failed_index_;
+            lock.unlock();
+            const char* failure = nullptr;
+            uint64_t index = 0;
+            for (const auto& job : batch) {
+                if (job.index > failed_index) break;
+                failure = verify(job, &buffer);
+                if (failure) {
+                    index = job.index;
+                    break;
+                }
+            }
+            lock.lock();
+            if (failure && index < failed_index_) {
+                failed_index_ = index;
+                failure_ = failure;
+                queue_space_.notify_all();
+            }
         }
     }
 
-    return buffer;
-}
+    // Returns why |job| failed, or nullptr if it passed.
+    const char* verify(const Job& job, std::vector<char>* buffer) const {
+        buffer->resize(job.size);
+        for (const auto& run : job.runs) {
+            size_t i = run.offset * kSectorSize;
+            size_t len = std::min<size_t>(run.count * kSectorSize, job.size - i);
+            if (pread64(device_fd_, &(*buffer)[i], len, run.target * kSectorSize) !=
+                static_cast<ssize_t>(len)) {
+                return "Failed to read sector";
+            }
+        }
+
+        uint32_t checksum = job.seed;
+        for (size_t i = 0; i < job.size; i += block_size_) {
+            checksum = Crc32(checksum, &(*buffer)[i], block_size_);
+        }
+        if (job.checksum && checksum != job.checksum) return "Checksums don't match";
+        return nullptr;
+    }
+
+    int device_fd_;
+    uint32_t block_size_;
+    uint64_t next_index_ = 0;
+    // Without threads, entries are checked as they come, into buffer_.
+    std::vector<std::thread> threads_;
+    std::vector<char> buffer_;
+    std::vector<Job> batch_;
+    bool reported_ = false;
+
+    std::mutex lock_;
+    std::condition_variable queue_ready_;
+    std::condition_variable queue_space_;
+    std::deque<std::vector<Job>> queue_;
+    bool done_ = false;
+    // The first entry in log order that failed, and why.
+    uint64_t failed_index_ = UINT64_MAX;
+    std::string failure_;
+};
 
 }  // namespace
 
@@ -634,11 +1089,16 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
     bool validating = true;
     std::string action = "Validating";
     int restore_count = 0;
+    // The log is counted by whichever pass goes through it first.
+    bool log_counted = false;
 
     for (;;) {
         Relocations relocations;
-        relocations[0] = 0;
         Status status = Status::ok();
+        auto pass_start = std::chrono::steady_clock::now();
+        uint64_t log_sectors = 0;
+        uint64_t log_entries = 0;
+        uint64_t pass_bytes = 0;
 
         LOG(INFO) << action << " checkpoint on " << blockDevice;
         base::unique_fd device_fd(open(blockDevice.c_str(), O_RDWR | O_CLOEXEC));
@@ -650,6 +1110,10 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
             return error(EINVAL, "Cannot read sector");
         }
         if (original_ls.magic == kPartialRestoreMagic) {
+            if (validating) {
+                std::lock_guard<std::mutex> lock(metricsLock);
+                metrics.partial_restore_restarts++;
+            }
             validating = false;
             action = "Restoring";
         } else if (original_ls.magic != kMagic) {
@@ -662,10 +1126,16 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
 
         LOG(INFO) << action << " " << original_ls.sequence << " log sectors";
 
+        RestoreWriter writer(device_fd);
+        std::optional<Validator> validator;
+        if (validating) {
+            // block_size is packed, so it can't be passed by reference.
+            validator.emplace(device_fd, static_cast<uint32_t>(original_ls.block_size));
+        }
+        std::vector<char> ls_buffer;
         for (int sequence = original_ls.sequence; sequence >= 0 && status.isOk(); sequence--) {
-            auto ls_buffer = relocatedRead(device_fd, relocations, validating, 0,
-                                           original_ls.block_size, original_ls.block_size);
-            if (ls_buffer.size() != original_ls.block_size) {
+            if (!relocatedRead(device_fd, relocations, validating, 0, original_ls.block_size,
+                               &ls_buffer)) {
                 status = error(EINVAL, "Failed to read log sector");
                 break;
             }
@@ -699,6 +1169,7 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
                 break;
             }
             LOG(INFO) << action << " from log sector " << ls.sequence;
+            log_sectors++;
             for (log_entry* le =
                      reinterpret_cast<log_entry*>(&ls_buffer[ls.header_size]) + ls.count - 1;
                  le >= reinterpret_cast<log_entry*>(&ls_buffer[ls.header_size]); --le) {
@@ -711,15 +1182,31 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
                     status = error(EINVAL, "log entry is invalid");
                     break;
                 }
-                auto buffer = relocatedRead(device_fd, relocations, validating, le->dest, le->size,
-                                            ls.block_size);
-                if (buffer.size() != le->size) {
+                log_entries++;
+                sector_t count = (le->size - 1) / kSectorSize + 1;
+                if (validating) {
+                    pass_bytes += le->size;
+                    if (!validator->check(relocations, *le)) {
+                        status = validator->finish(status);
+                        break;
+                    }
+                    relocations.relocate(le->source, le->dest, count);
+                    continue;
+                }
+
+                // The entry's data may not have been written yet.
+                if (writer.overlaps(le->dest, le->dest + count) && !writer.flush()) {
+                    status = error(EIO, "Failed to write restored sectors");
+                    break;
+                }
+                std::vector<char>& buffer = writer.nextBuffer();
+                if (!relocatedRead(device_fd, relocations, false, le->dest, le->size, &buffer)) {
                     status = error(EINVAL, "Failed to read sector");
                     break;
                 }
                 uint32_t checksum = le->source / (ls.block_size / kSectorSize);
                 for (size_t i = 0; i < le->size; i += ls.block_size) {
-                    crc32(&buffer[i], ls.block_size, &checksum);
+                    checksum = Crc32(checksum, &buffer[i], ls.block_size);
                 }
 
                 if (le->checksum && checksum != le->checksum) {
@@ -727,19 +1214,47 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
                     break;
                 }
 
-                if (validating) {
-                    relocate(relocations, le->source, le->dest, (le->size - 1) / kSectorSize + 1);
-                } else {
-                    restoreSector(device_fd, used_sectors, ls_buffer, le, buffer);
-                    restore_count++;
-                    if (restore_limit && restore_count >= restore_limit) {
-                        status = error(EAGAIN, "Hit the test limit");
-                        break;
-                    }
+                if (!restoreSector(writer, used_sectors, ls_buffer, le)) {
+                    status = error(EIO, "Failed to restore sector");
+                    break;
+                }
+                pass_bytes += le->size;
+                restore_count++;
+                if (restore_limit && restore_count >= restore_limit) {
+                    status = error(EAGAIN, "Hit the test limit");
+                    break;
                 }
             }
         }
 
+        // A failure in an entry still being checked comes before any failure
+        // found after it.
+        if (validator) status = validator->finish(status);
+
+        // Whatever got restored has to reach the device, even if the restore
+        // stopped early.
+        if (!validating && !writer.flush() && status.isOk()) {
+            status = error(EIO, "Failed to write restored sectors");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(metricsLock);
+            auto pass_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - pass_start);
+            if (validating) {
+                metrics.bytes_validated += pass_bytes;
+                metrics.validate_time += pass_time;
+            } else {
+                metrics.bytes_restored += pass_bytes;
+                metrics.restore_time += pass_time;
+            }
+            if (!log_counted) {
+                metrics.log_sectors += log_sectors;
+                metrics.log_entries += log_entries;
+                log_counted = true;
+            }
+        }
+
         if (!status.isOk()) {
             if (!validating) {
                 LOG(ERROR) << "Checkpoint restore failed even though checkpoint validation passed";
@@ -747,16 +1262,13 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
             }
 
             LOG(WARNING) << "Checkpoint validation failed - attempting to roll forward";
-            auto buffer = relocatedRead(device_fd, relocations, false, original_ls.sector0,
-                                        original_ls.block_size, original_ls.block_size);
-            if (buffer.size() != original_ls.block_size) {
+            std::vector<char> buffer;
+            if (!relocatedRead(device_fd, relocations, false, original_ls.sector0,
+                               original_ls.block_size, &buffer)) {
                 return error(EINVAL, "Failed to read original sector");
             }
 
-            if (lseek64(device_fd, 0, SEEK_SET) != 0) {
-                return error(EINVAL, "Failed to seek to sector 0");
-            }
-            if (write(device_fd, &buffer[0], original_ls.block_size) !=
+            if (pwrite64(device_fd, &buffer[0], original_ls.block_size, 0) !=
                 static_cast<ssize_t>(original_ls.block_size)) {
                 return error(EINVAL, "Failed to write original sector");
             }
@@ -801,5 +1313,10 @@ void cp_resetCheckpoint() {
     needsCheckpointWasCalled = false;
 }
 
+CheckpointMetrics cp_getMetrics() {
+    std::lock_guard<std::mutex> lock(metricsLock);
+    return metrics;
+}
+
 }  // namespace vold
 }  // namespace android
@@ -18,6 +18,7 @@
 #define _CHECKPOINT_H
 
 #include <binder/Status.h>
+#include <chrono>
 #include <string>
 
 namespace android {
@@ -48,6 +49,24 @@ android::binder::Status cp_restoreCheckpoint(const std::string& mountPoint, int
 android::binder::Status cp_markBootAttempt();
 
 void cp_resetCheckpoint();
+
+// Numbers about the checkpoints handled since boot.
+struct CheckpointMetrics {
+    // In the dm-bow logs that were restored.
+    uint64_t log_sectors = 0;
+    uint64_t log_entries = 0;
+    uint64_t bytes_validated = 0;
+    uint64_t bytes_restored = 0;
+    std::chrono::milliseconds validate_time{0};
+    std::chrono::milliseconds restore_time{0};
+    // Restores that resumed one that was interrupted.
+    uint32_t partial_restore_restarts = 0;
+    std::chrono::milliseconds commit_time{0};
+    // The most free space a checkpoint has used up, as seen by the health daemon.
+    uint64_t peak_space_used = 0;
+};
+
+CheckpointMetrics cp_getMetrics();
 }  // namespace vold
 }  // namespace android
 
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Crc32.h"
+
+#include <endian.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace android {
+namespace vold {
+
+namespace {
+
+using Crc32Fn = uint32_t (*)(uint32_t crc, const uint8_t* p, size_t n);
+
+const uint32_t kTable[0x100] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
+    0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
+    0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
+    0x6DDDE4EB, 0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
+    0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4,
+    0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC,
+    0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+    0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB,
+    0xB6662D3D,
+
+    0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5,
+    0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED,
+    0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
+    0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE, 0xA3BC0074,
+    0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC,
+    0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C,
+    0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B,
+    0xC0BA6CAD,
+
+    0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615,
+    0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D,
+    0x0A00AE27, 0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D,
+    0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4,
+    0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B, 0xD80D2BDA, 0xAF0A1B4C,
+    0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79, 0xCB61B38C,
+    0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+    0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B,
+    0x5BDEAE1D,
+
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785,
+    0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D,
+    0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD,
+    0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
+    0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354,
+    0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C,
+    0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+    0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B,
+    0x2D02EF8D};
+
+uint32_t Crc32Bytewise(uint32_t crc, const uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        crc ^= p[i];
+        crc = kTable[(uint8_t)crc] ^ crc >> 8;
+    }
+    return crc;
+}
+
+// tables[k][i] is the CRC of byte i followed by k zero bytes, so that eight
+// bytes can be folded in with eight independent lookups.
+struct SlicingTables {
+    uint32_t tables[8][0x100];
+};
+
+constexpr SlicingTables MakeSlicingTables() {
+    SlicingTables t = {};
+    for (int i = 0; i < 0x100; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+        t.tables[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 0x100; i++) {
+            uint32_t prev = t.tables[k - 1][i];
+            t.tables[k][i] = (prev >> 8) ^ t.tables[0][prev & 0xff];
+        }
+    }
+    return t;
+}
+
+constexpr SlicingTables kSlicingTables = MakeSlicingTables();
+
+uint32_t Crc32SlicingBy8(uint32_t crc, const uint8_t* p, size_t n) {
+    const auto& t = kSlicingTables.tables;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v = le64toh(v);
+        uint32_t lo = static_cast<uint32_t>(v) ^ crc;
+        uint32_t hi = static_cast<uint32_t>(v >> 32);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^
+              t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+              t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    return Crc32Bytewise(crc, p, n);
+}
+
+#if defined(__aarch64__)
+
+// The CRC32 instructions are optional in ARMv8.0, so the rest of vold can't be
+// built to use them; this function is compiled for them separately.
+__attribute__((target("crc"))) uint32_t Crc32Armv8(uint32_t crc, const uint8_t* p, size_t n) {
+    for (; n > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0; p++, n--) crc = __crc32b(crc, *p);
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32d(crc, v);
+    }
+    for (; n > 0; p++, n--) crc = __crc32b(crc, *p);
+    return crc;
+}
+
+bool Armv8Supported() {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+#define TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+
+TARGET_PCLMUL inline __m128i LoadBlock(const uint8_t* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+// Multiplies the two halves of |x| by the two constants in |k| and adds the
+// products to |y|, folding |x| forward over the distance that |k| is for.
+TARGET_PCLMUL inline __m128i FoldBlock(__m128i x, __m128i k, __m128i y) {
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(hi, lo), y);
+}
+
+// Folds 64-byte blocks with carry-less multiplication, then reduces to 32 bits
+// with Barrett reduction.  This follows Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction", with the constants for the
+// bit-reflected IEEE polynomial.  |n| must be a multiple of 16, and at least 64.
+TARGET_PCLMUL uint32_t Crc32PclmulBlocks(uint32_t crc, const uint8_t* p, size_t n) {
+    alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+    __m128i x1 = _mm_xor_si128(LoadBlock(p), _mm_cvtsi32_si128(crc));
+    __m128i x2 = LoadBlock(p + 0x10);
+    __m128i x3 = LoadBlock(p + 0x20);
+    __m128i x4 = LoadBlock(p + 0x30);
+    p += 64;
+    n -= 64;
+
+    __m128i k = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+    for (; n >= 64; p += 64, n -= 64) {
+        x1 = FoldBlock(x1, k, LoadBlock(p));
+        x2 = FoldBlock(x2, k, LoadBlock(p + 0x10));
+        x3 = FoldBlock(x3, k, LoadBlock(p + 0x20));
+        x4 = FoldBlock(x4, k, LoadBlock(p + 0x30));
+    }
+
+    // Fold the four lanes into one, then any remaining 16-byte blocks into it.
+    k = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+    x1 = FoldBlock(x1, k, x2);
+    x1 = FoldBlock(x1, k, x3);
+    x1 = FoldBlock(x1, k, x4);
+    for (; n >= 16; p += 16, n -= 16) x1 = FoldBlock(x1, k, LoadBlock(p));
+
+    // Fold 128 bits down to 64.
+    __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits.
+    k = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+uint32_t Crc32Pclmul(uint32_t crc, const uint8_t* p, size_t n) {
+    if (n >= 64) {
+        size_t blocks = n & ~size_t(15);
+        crc = Crc32PclmulBlocks(crc, p, blocks);
+        p += blocks;
+        n -= blocks;
+    }
+    return Crc32SlicingBy8(crc, p, n);
+}
+
+bool PclmulSupported() {
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+#endif
+
+Crc32Fn GetImpl(Crc32Impl impl) {
+    switch (impl) {
+        case Crc32Impl::kBytewise:
+            return Crc32Bytewise;
+        case Crc32Impl::kSlicingBy8:
+            return Crc32SlicingBy8;
+        case Crc32Impl::kArmv8:
+#if defined(__aarch64__)
+            if (Armv8Supported()) return Crc32Armv8;
+#endif
+            return nullptr;
+        case Crc32Impl::kPclmul:
+#if defined(__x86_64__) || defined(__i386__)
+            if (PclmulSupported()) return Crc32Pclmul;
+#endif
+            return nullptr;
+    }
+    return nullptr;
+}
+
+Crc32Fn ChooseImpl() {
+    if (auto fn = GetImpl(Crc32Impl::kArmv8)) return fn;
+    if (auto fn = GetImpl(Crc32Impl::kPclmul)) return fn;
+    return Crc32SlicingBy8;
+}
+
+}  // namespace
+
+uint32_t Crc32(uint32_t crc, const void* data, size_t n_bytes) {
+    static const Crc32Fn fn = ChooseImpl();
+    return fn(crc, static_cast<const uint8_t*>(data), n_bytes);
+}
+
+bool Crc32ImplSupported(Crc32Impl impl) {
+    return GetImpl(impl) != nullptr;
+}
+
+uint32_t Crc32With(Crc32Impl impl, uint32_t crc, const void* data, size_t n_bytes) {
+    return GetImpl(impl)(crc, static_cast<const uint8_t*>(data), n_bytes);
+}
+
+}  // namespace vold
+}  // namespace android
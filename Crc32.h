@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_CRC32_H
+#define ANDROID_VOLD_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+// Implementations of the CRC-32 used by dm-bow's log checksums.  This is the
+// IEEE 802.3 polynomial, bit-reflected, but with no inversion of the CRC before
+// or after, so that checksums can be chained by passing one call's result as
+// the next call's |crc|.
+enum class Crc32Impl {
+    kBytewise,    // The 256-entry table, one byte at a time
+    kSlicingBy8,  // Eight 256-entry tables, eight bytes at a time
+    kArmv8,       // ARMv8 CRC32 instructions
+    kPclmul,      // x86 carry-less multiplication (PCLMULQDQ) folding
+};
+
+// Returns the CRC-32 of |data| continuing from |crc|, using the fastest
+// implementation that the CPU supports.
+uint32_t Crc32(uint32_t crc, const void* data, size_t n_bytes);
+
+// As Crc32(), but with a specific implementation.  For testing.
+bool Crc32ImplSupported(Crc32Impl impl);
+uint32_t Crc32With(Crc32Impl impl, uint32_t crc, const void* data, size_t n_bytes);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -19,57 +19,453 @@
 #include <ext4_utils/ext4.h>
 #include <ext4_utils/ext4_utils.h>
 #include <f2fs_sparseblock.h>
+#include <endian.h>
 #include <fcntl.h>
+#include <openssl/sha.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 
+#include "Utils.h"
+
 enum EncryptInPlaceError {
     kSuccess,
     kFailed,
     kFilesystemNotFound,
 };
 
+// Reads the queue limit |name| (e.g. "max_sectors_kb") of the block device
+// that |fd| refers to.  Partitions don't have their own queue directory, so
+// fall back to the one of the disk containing them.  Returns 0 if unknown.
+static uint64_t read_queue_limit(int fd, const std::string& name) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode)) return 0;
+
+    std::string dev_dir =
+            android::base::StringPrintf("/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+    std::string contents;
+    if (!android::base::ReadFileToString(dev_dir + "/queue/" + name, &contents) &&
+        !android::base::ReadFileToString(dev_dir + "/../queue/" + name, &contents))
+        return 0;
+
+    uint64_t value;
+    if (!android::base::ParseUint(android::base::Trim(contents), &value)) return 0;
+    return value;
+}
+
+// Rounds |val| down to a power of 2.  |val| must be nonzero.
+static uint64_t round_down_pow2(uint64_t val) {
+    return 1ULL << (63 - __builtin_clzll(val));
+}
+
+struct BlockExtent {
+    uint64_t first_block;
+    uint64_t num_blocks;
+};
+
+// Adds the |num_blocks| blocks starting at |first_block| to the end of
+// |extents|, extending the last extent if they are contiguous with it.
+static void append_extent(std::vector<BlockExtent>* extents, uint64_t first_block,
+                          uint64_t num_blocks) {
+    if (!extents->empty()) {
+        BlockExtent& last = extents->back();
+        if (last.first_block + last.num_blocks == first_block) {
+            last.num_blocks += num_blocks;
+            return;
+        }
+    }
+    extents->push_back({first_block, num_blocks});
+}
+
+// Format of the file that records the progress of a resumable in-place
+// encryption.  The header is followed by |num_entries| ProgressEntry structs,
+// sorted by block number.
+//
+// Blocks are encrypted in windows of a few tens of MB.  Before any block of a
+// window is written, the file is replaced with one listing a hash of the
+// original contents of every block in the window, and the crypto device is
+// synced once the whole window has been written.  So if encryption is
+// interrupted, every used block before |resume_block| has been encrypted, and
+// each block listed in the file either still has its original contents on the
+// real block device (matching the hash) or has been encrypted (so that reading
+// it through the crypto device matches the hash).
+//
+// The filesystem metadata needed to find the used blocks is encrypted last, in
+// a final window with |deferred| set, so that it can still be read from the
+// real block device when resuming.  A deferred window lists all its blocks.
+struct InPlaceProgressHeader {
+    uint32_t magic;
+    uint32_t version;
+    char fs_type[8];
+    uint64_t nr_sec;
+    uint32_t block_size;
+    uint32_t deferred;
+    uint64_t resume_block;
+    uint64_t num_entries;
+};
+static_assert(sizeof(InPlaceProgressHeader) == 48, "Unexpected InPlaceProgressHeader size");
+
+struct ProgressEntry {
+    uint64_t block;
+    uint64_t hash;  // first 8 bytes of the SHA-256 of the block's original contents
+};
+
+static const uint32_t kProgressMagic = 0x50454956;  // "VIEP"
+static const uint32_t kProgressVersion = 1;
+
+static bool entry_block_less(const ProgressEntry& entry, uint64_t block) {
+    return entry.block < block;
+}
+
 static uint64_t round_up(uint64_t val, size_t amount) {
     if (val % amount) val += amount - (val % amount);
     return val;
 }
 
+// Returns the index of the first bit at or after |bit| in the little-endian
+// bitmap |bitmap| that is set (if |set|) or clear (if !|set|), or |nbits| if
+// there is none.  The bitmap is scanned 64 bits at a time, so long runs of
+// used or free blocks are skipped over quickly.
+static uint32_t find_next_bit(const uint8_t* bitmap, uint32_t nbits, uint32_t bit, bool set) {
+    const uint32_t nbytes = (nbits + 7) / 8;
+
+    while (bit < nbits) {
+        uint32_t byte = (bit / 64) * 8;
+        uint64_t word = 0;
+        memcpy(&word, &bitmap[byte], std::min<uint32_t>(8, nbytes - byte));
+        word = le64toh(word);
+        if (!set) word = ~word;
+        // Ignore the bits before |bit|.
+        word &= ~0ULL << (bit % 64);
+        if (word != 0) return std::min<uint32_t>(byte * 8 + __builtin_ctzll(word), nbits);
+        bit = byte * 8 + 64;
+    }
+    return nbits;
+}
+
+// Calls |fn(start, count)| for each run of set bits among the first |nbits|
+// bits of |bitmap|, in order.  Stops and returns false if |fn| returns false.
+template <typename Fn>
+static bool for_each_set_bit_run(const uint8_t* bitmap, uint32_t nbits, Fn fn) {
+    uint32_t start = find_next_bit(bitmap, nbits, 0, true);
+    while (start < nbits) {
+        uint32_t end = find_next_bit(bitmap, nbits, start, false);
+        if (!fn(start, end - start)) return false;
+        start = find_next_bit(bitmap, nbits, end, true);
+    }
+    return true;
+}
+
+// Copies ranges of bytes from the real block device to the crypto block device.
+// Each request is a read from one device followed by a write of the same range
+// to the other, so requests don't depend on each other and can complete in any
+// order.  Up to |depth| requests are kept in flight by a pool of I/O threads,
+// each of which owns one I/O buffer.  With a depth of 1, no threads are created
+// and each request is done synchronously by Submit().
+//
+// A request can also be just the read or just the write, to or from memory
+// that the caller provides; see SubmitRead() and SubmitWrite().
+class InPlaceIoQueue {
+  public:
+    ~InPlaceIoQueue() { Stop(); }
+
+    void Init(int realfd, int cryptofd, const std::string& real_blkdev,
+              const std::string& crypto_blkdev, size_t buffer_size, size_t depth);
+    // Queues a copy of |bytes| bytes at |offset|, waiting for a free buffer if
+    // all of them are in use.  Returns false if any earlier request failed.
+    bool Submit(uint64_t offset, size_t bytes);
+    // Queue just a read of the range from the real block device into |data|, or
+    // just a write of it to the crypto block device from |data|.  |data| must
+    // stay valid and untouched until Drain() has returned.
+    bool SubmitRead(uint64_t offset, size_t bytes, uint8_t* data);
+    bool SubmitWrite(uint64_t offset, size_t bytes, const uint8_t* data);
+    // Waits for all queued requests to complete.  Returns false if any failed.
+    bool Drain();
+    size_t buffer_size() const { return buffer_size_; }
+    // Adds the number of read and write calls made, and the time that callers
+    // spent waiting in Submit() and Drain(), to |stats|.
+    void AddStats(EncryptInPlaceStats* stats);
+
+  private:
+    enum class Op { kCopy, kRead, kWrite };
+    struct Request {
+        Op op;
+        uint64_t offset;
+        size_t bytes;
+        // The caller's memory for kRead and kWrite; kCopy uses a worker's buffer.
+        uint8_t* data;
+    };
+
+    bool DoRequest(uint8_t* buffer, const Request& req);
+    bool Queue(const Request& req);
+    void WorkerLoop(size_t index);
+    void Stop();
+
+    int realfd_ = -1;
+    int cryptofd_ = -1;
+    std::string real_blkdev_;
+    std::string crypto_blkdev_;
+    size_t buffer_size_ = 0;
+
+    std::vector<std::vector<uint8_t>> buffers_;
+    std::vector<std::thread> workers_;
+
+    std::mutex lock_;
+    std::condition_variable work_cond_;  // signaled when a request is queued
+    std::condition_variable done_cond_;  // signaled when a request completes
+    std::deque<Request> queue_;
+    size_t outstanding_ = 0;  // queued plus in-progress requests
+    bool failed_ = false;
+    bool stopping_ = false;
+
+    std::atomic<uint64_t> read_calls_ = 0;
+    std::atomic<uint64_t> write_calls_ = 0;
+    std::chrono::nanoseconds wait_time_{0};
+};
+
+void InPlaceIoQueue::Init(int realfd, int cryptofd, const std::string& real_blkdev,
+                          const std::string& crypto_blkdev, size_t buffer_size, size_t depth) {
+    Stop();
+
+    realfd_ = realfd;
+    cryptofd_ = cryptofd;
+    real_blkdev_ = real_blkdev;
+    crypto_blkdev_ = crypto_blkdev;
+    buffer_size_ = buffer_size;
+    failed_ = false;
+    stopping_ = false;
+
+    depth = std::max<size_t>(depth, 1);
+    buffers_.assign(depth, std::vector<uint8_t>(buffer_size));
+    if (depth == 1) return;
+
+    for (size_t i = 0; i < depth; i++) {
+        workers_.emplace_back(&InPlaceIoQueue::WorkerLoop, this, i);
+    }
+}
+
+bool InPlaceIoQueue::DoRequest(uint8_t* buffer, const Request& req) {
+    ssize_t bytes = req.bytes;
+    if (req.op != Op::kCopy) buffer = req.data;
+
+    if (req.op != Op::kWrite) {
+        read_calls_++;
+        if (pread64(realfd_, buffer, bytes, req.offset) != bytes) {
+            PLOG(ERROR) << "Error reading real_blkdev " << real_blkdev_ << " for inplace encrypt";
+            return false;
+        }
+    }
+    if (req.op == Op::kRead) return true;
+
+    write_calls_++;
+    if (pwrite64(cryptofd_, buffer, bytes, req.offset) != bytes) {
+        PLOG(ERROR) << "Error writing crypto_blkdev " << crypto_blkdev_ << " for inplace encrypt";
+        return false;
+    }
+    return true;
+}
+
+void InPlaceIoQueue::WorkerLoop(size_t index) {
+    uint8_t* buffer = buffers_[index].data();
+
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+        work_cond_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) return;
+
+        Request req = queue_.front();
+        queue_.pop_front();
+
+        // Once something has failed, the remaining requests are just discarded.
+        bool skip = failed_;
+        lock.unlock();
+        bool ok = skip || DoRequest(buffer, req);
+        lock.lock();
+
+        if (!ok) failed_ = true;
+        outstanding_--;
+        done_cond_.notify_all();
+    }
+}
+
+bool InPlaceIoQueue::Submit(uint64_t offset, size_t bytes) {
+    return Queue({Op::kCopy, offset, bytes, nullptr});
+}
+
+bool InPlaceIoQueue::SubmitRead(uint64_t offset, size_t bytes, uint8_t* data) {
+    return Queue({Op::kRead, offset, bytes, data});
+}
+
+bool InPlaceIoQueue::SubmitWrite(uint64_t offset, size_t bytes, const uint8_t* data) {
+    // The data is only ever passed to pwrite64().
+    return Queue({Op::kWrite, offset, bytes, const_cast<uint8_t*>(data)});
+}
+
+bool InPlaceIoQueue::Queue(const Request& req) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (workers_.empty()) {
+        if (failed_) return false;
+        if (!DoRequest(buffers_[0].data(), req)) failed_ = true;
+        wait_time_ += std::chrono::steady_clock::now() - start;
+        return !failed_;
+    }
+
+    std::unique_lock<std::mutex> lock(lock_);
+    done_cond_.wait(lock, [this] { return failed_ || outstanding_ < workers_.size(); });
+    wait_time_ += std::chrono::steady_clock::now() - start;
+    if (failed_) return false;
+
+    queue_.push_back(req);
+    outstanding_++;
+    work_cond_.notify_one();
+    return true;
+}
+
+bool InPlaceIoQueue::Drain() {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(lock_);
+    done_cond_.wait(lock, [this] { return outstanding_ == 0; });
+    wait_time_ += std::chrono::steady_clock::now() - start;
+    return !failed_;
+}
+
+void InPlaceIoQueue::AddStats(EncryptInPlaceStats* stats) {
+    std::lock_guard<std::mutex> lock(lock_);
+    stats->read_calls += read_calls_;
+    stats->write_calls += write_calls_;
+    stats->io_wait_time += wait_time_;
+}
+
+void InPlaceIoQueue::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stopping_ = true;
+    }
+    work_cond_.notify_all();
+    for (auto& worker : workers_) worker.join();
+    workers_.clear();
+}
+
+// A sequence of in-use blocks being encrypted: the run of contiguous blocks
+// that hasn't been submitted yet, and the queue it will be submitted to.  The
+// encrypter has one main stream; when ext4 block groups are encrypted in
+// parallel, each worker has its own.
+struct InPlaceStream {
+    InPlaceIoQueue io_queue;
+    uint64_t first_pending_block = 0;
+    size_t blocks_pending = 0;
+};
+
 class InPlaceEncrypter {
   public:
     bool EncryptInPlace(const std::string& crypto_blkdev, const std::string& real_blkdev,
-                        uint64_t nr_sec);
-    bool ProcessUsedBlock(uint64_t block_num);
+                        uint64_t nr_sec, const std::string& progress_path,
+                        const EncryptInPlaceProgressCallback& on_progress);
+    const EncryptInPlaceStats& stats() const { return stats_; }
+    bool ProcessUsedExtent(uint64_t first_block, uint64_t num_blocks);
 
   private:
     // aligned 32K writes tends to make flash happy.
-    // SD card association recommends it.
+    // SD card association recommends it.  This is only the fallback for when
+    // the block device's queue limits can't be read; see ChooseIOBufferSize().
     static const size_t kIOBufferSize = 32768;
 
+    // Limits on the I/O buffer size chosen from the queue limits.  Larger
+    // requests don't get any faster, and the buffers are per I/O thread.
+    static const size_t kMinIOBufferSize = 32768;
+    static const size_t kMaxIOBufferSize = 1024 * 1024;
+
+    // Overrides the I/O buffer size (and alignment) chosen from the queue
+    // limits, in KiB.
+    static constexpr const char* kIOSizeProp = "ro.crypto.inplace_encrypt.io_size_kb";
+    static const size_t kMaxIOSizeOverrideKb = 16 * 1024;
+
+    // Number of read+write requests kept in flight at once.  A single request
+    // at a time leaves fast storage (e.g. UFS) mostly idle waiting on latency.
+    static const size_t kIODepth = 8;
+
     // Avoid spamming the logs.  Print the "Encrypting blocks" log message once
     // every 10000 blocks (which is usually every 40 MB or so), and once at the end.
     static const int kLogInterval = 10000;
 
+    // Progress is reported to the caller's callback at most this often, plus
+    // once at the start and once at the end.  The ETA uses a moving average of
+    // the throughput, with this weight given to the latest interval.
+    static constexpr std::chrono::milliseconds kReportInterval{1000};
+    static constexpr double kThroughputWeight = 0.25;
+
+    // Number of threads to split the ext4 block groups across.  Each one reads
+    // the block bitmaps and encrypts the used blocks of the groups it takes,
+    // using its own fds and I/O buffer.  The default of 1 encrypts the groups
+    // in order on the calling thread.  Progress can't be saved when the groups
+    // are encrypted out of order, so setting this above 1 means that an
+    // interrupted encryption can't be resumed.
+    static constexpr const char* kThreadsProp = "ro.crypto.inplace_encrypt.threads";
+    static const unsigned int kMaxThreads = 16;
+
+    // When progress is being saved, it's committed after every this many bytes
+    // of used blocks have been encrypted, or this many blocks, whichever is
+    // reached first.  The latter limits the size of the progress file.  Each
+    // window is held in memory while its blocks are hashed, so that they can be
+    // encrypted from the same copy rather than read a second time, and a second
+    // one while the previous window is still being written.
+    static const uint64_t kProgressInterval = 32 * 1024 * 1024;
+    static const uint64_t kMaxProgressEntries = 65536;
+
     std::string DescribeFilesystem();
-    void InitFs(const std::string& fs_type, uint64_t blocks_to_encrypt, uint64_t total_blocks,
+    size_t ChooseIOBufferSize(unsigned int block_size);
+    bool InitFs(const std::string& fs_type, uint64_t blocks_to_encrypt, uint64_t total_blocks,
                 unsigned int block_size);
     void UpdateProgress(size_t blocks, bool done);
-    bool EncryptPendingData();
+    void ReportProgress(bool force);
+    bool ProcessUsedExtent(InPlaceStream* stream, uint64_t first_block, uint64_t num_blocks);
+    bool EncryptPendingData(InPlaceStream* stream);
     bool DoEncryptInPlace();
 
     // ext4 methods
-    bool ReadExt4BlockBitmap(uint32_t group, uint8_t* buf);
+    bool ReadExt4BlockBitmap(int fd, uint32_t group, uint8_t* buf);
     uint64_t FirstBlockInGroup(uint32_t group);
     uint32_t NumBlocksInGroup(uint32_t group);
     uint32_t NumBaseMetaBlocksInGroup(uint64_t group);
+    bool EncryptExt4Group(InPlaceStream* stream, int realfd, uint32_t group, uint8_t* bitmap);
+    void EncryptExt4GroupsWorker(std::atomic<uint32_t>* next_group, std::atomic<bool>* failed);
+    bool EncryptExt4GroupsInParallel(unsigned int num_threads);
     EncryptInPlaceError EncryptInPlaceExt4();
 
     // f2fs methods
     EncryptInPlaceError EncryptInPlaceF2fs();
 
+    // Methods for saving progress and resuming
+    uint64_t HashBlock(const uint8_t* data);
+    bool ReadBlockHash(int fd, uint64_t block, uint64_t* hash);
+    bool LoadProgress();
+    bool SaveProgress(bool deferred, uint64_t resume_block, std::vector<ProgressEntry> entries);
+    bool RemoveProgress();
+    bool FindAlreadyEncryptedBlocks();
+    bool AddToWindow(uint64_t first_block, uint64_t num_blocks);
+    bool CommitWindow(bool deferred);
+    bool SyncWindowWrites();
+    bool CommitDeferredWindow();
+    bool ResumeDeferredWindow();
+
     std::string real_blkdev_;
     std::string crypto_blkdev_;
     uint64_t nr_sec_;
@@ -77,14 +473,62 @@ class InPlaceEncrypter {
     android::base::unique_fd realfd_;
     android::base::unique_fd cryptofd_;
 
+    // Declared after the fds so that it's destroyed, and its I/O threads are
+    // stopped, before the fds get closed.
+    InPlaceStream stream_;
+
     std::string fs_type_;
-    uint64_t blocks_done_;
     uint64_t blocks_to_encrypt_;
-    unsigned int block_size_;
+    unsigned int block_size_ = 0;
+    size_t io_buffer_size_;
+
+    // Protects blocks_done_, stats_ and the progress reporting state, which are
+    // updated by all streams.
+    std::mutex progress_lock_;
+    uint64_t blocks_done_ = 0;
+    EncryptInPlaceStats stats_;
+
+    EncryptInPlaceProgressCallback on_progress_;
+    std::chrono::steady_clock::time_point last_report_time_;
+    uint64_t last_report_blocks_ = 0;
+    double avg_bytes_per_sec_ = 0;
+
+    // Whether progress is being saved to |progress_path_|.
+    std::string progress_path_;
+    bool saving_progress_ = false;
+
+    // The saved progress of the interrupted encryption being resumed, if any.
+    // |resume_done_| holds the entries of the saved window that turned out to
+    // be encrypted already; they are carried over into newly saved windows
+    // until the resume point passes them.
+    bool resuming_ = false;
+    std::string resume_fs_type_;
+    unsigned int resume_block_size_ = 0;
+    bool resume_deferred_ = false;
+    uint64_t resume_block_ = 0;
+    std::vector<ProgressEntry> resume_window_;
+    std::vector<ProgressEntry> resume_done_;
+
+    // Sorted ranges of blocks which must be encrypted last (see
+    // InPlaceProgressHeader), and the used blocks in them that were found.
+    std::vector<BlockExtent> deferred_ranges_;
+    size_t next_deferred_range_ = 0;
+    std::vector<BlockExtent> deferred_extents_;
+
+    // The used blocks collected for the next window, and the memory that the
+    // window gets read into when it's committed.
+    std::vector<BlockExtent> window_;
+    uint64_t window_blocks_ = 0;
+    std::vector<uint8_t> window_data_;
 
-    std::vector<uint8_t> io_buffer_;
-    uint64_t first_pending_block_;
-    size_t blocks_pending_;
+    // The last committed window, whose writes may still be in flight, and
+    // whether they have to be synced before the next window's progress is saved.
+    // The queue's requests only write from |writing_data_|, so it has no
+    // buffers of its own.  Declared last, so that its I/O threads are stopped
+    // before the data goes away.
+    std::vector<uint8_t> writing_data_;
+    bool writes_unsynced_ = false;
+    InPlaceIoQueue window_writes_;
 };
 
 std::string InPlaceEncrypter::DescribeFilesystem() {
@@ -94,26 +538,93 @@ std::string InPlaceEncrypter::DescribeFilesystem() {
         return fs_type_ + " filesystem on " + real_blkdev_;
 }
 
+// Chooses the size of each I/O request, which is also the boundary that requests
+// are aligned to.  Large requests are much faster on modern storage (e.g. UFS),
+// so use the largest request that the block devices accept, up to
+// kMaxIOBufferSize, rounded down to a multiple of the device's optimal I/O size
+// if there's one that fits.  Unless that limit is below kMinIOBufferSize, the
+// result never exceeds it.
+size_t InPlaceEncrypter::ChooseIOBufferSize(unsigned int block_size) {
+    size_t override_kb = android::base::GetUintProperty<size_t>(kIOSizeProp, 0, kMaxIOSizeOverrideKb);
+    if (override_kb != 0) {
+        LOG(INFO) << "Using I/O size of " << override_kb << " KiB from " << kIOSizeProp;
+        return round_up(override_kb * 1024, block_size);
+    }
+
+    // Requests go through both devices, so respect the smaller limit.
+    uint64_t max_kb = 0;
+    for (int fd : {realfd_.get(), cryptofd_.get()}) {
+        uint64_t kb = read_queue_limit(fd, "max_sectors_kb");
+        if (kb != 0) max_kb = (max_kb == 0) ? kb : std::min(max_kb, kb);
+    }
+    if (max_kb == 0) return round_up(kIOBufferSize, block_size);
+
+    const uint64_t limit =
+            round_down_pow2(std::clamp<uint64_t>(max_kb * 1024, kMinIOBufferSize, kMaxIOBufferSize));
+
+    // An optimal I/O size larger than the limit can't be used, and neither can
+    // one that the alignment below would take back over it.
+    uint64_t size = limit;
+    uint64_t optimal = read_queue_limit(realfd_, "optimal_io_size");
+    if (optimal > 0 && optimal <= limit) size -= size % optimal;
+    uint64_t physical = read_queue_limit(realfd_, "physical_block_size");
+    if (physical > 0) size = round_up(size, physical);
+    size = round_up(size, block_size);
+    if (size > limit) size = round_up(limit, block_size);
+
+    LOG(DEBUG) << "Using I/O size of " << size << " bytes (max_sectors_kb=" << max_kb
+               << ", optimal_io_size=" << optimal << ", physical_block_size=" << physical << ")";
+    return size;
+}
+
 // Finishes initializing the encrypter, now that the filesystem details are known.
-void InPlaceEncrypter::InitFs(const std::string& fs_type, uint64_t blocks_to_encrypt,
+bool InPlaceEncrypter::InitFs(const std::string& fs_type, uint64_t blocks_to_encrypt,
                               uint64_t total_blocks, unsigned int block_size) {
     fs_type_ = fs_type;
     blocks_done_ = 0;
     blocks_to_encrypt_ = blocks_to_encrypt;
     block_size_ = block_size;
 
-    // Allocate the I/O buffer.  kIOBufferSize should always be a multiple of
-    // the filesystem block size, but round it up just in case.
-    io_buffer_.resize(round_up(kIOBufferSize, block_size));
-    first_pending_block_ = 0;
-    blocks_pending_ = 0;
+    // Allocate the I/O buffers.  Their size is always a multiple of the
+    // filesystem block size.
+    io_buffer_size_ = ChooseIOBufferSize(block_size);
+    stream_.io_queue.Init(realfd_, cryptofd_, real_blkdev_, crypto_blkdev_, io_buffer_size_,
+                          kIODepth);
+    stream_.first_pending_block = 0;
+    stream_.blocks_pending = 0;
+    if (saving_progress_) {
+        window_writes_.Init(realfd_, cryptofd_, real_blkdev_, crypto_blkdev_, 0, kIODepth);
+    }
 
     LOG(INFO) << "Encrypting " << DescribeFilesystem() << " in-place via " << crypto_blkdev_;
     LOG(INFO) << blocks_to_encrypt << " blocks (" << (blocks_to_encrypt * block_size) / 1000000
               << " MB) of " << total_blocks << " blocks are in-use";
+
+    {
+        std::lock_guard<std::mutex> lock(progress_lock_);
+        last_report_time_ = std::chrono::steady_clock::now();
+        last_report_blocks_ = 0;
+        avg_bytes_per_sec_ = 0;
+        ReportProgress(true);
+    }
+
+    if (resuming_) {
+        if (fs_type != resume_fs_type_ || block_size != resume_block_size_) {
+            LOG(ERROR) << "Saved in-place encryption progress is for a different filesystem ("
+                       << (resume_fs_type_.empty() ? "full block device" : resume_fs_type_)
+                       << " with " << resume_block_size_ << "-byte blocks)";
+            return false;
+        }
+        return FindAlreadyEncryptedBlocks();
+    }
+    // Record that encryption has started, before anything gets written.
+    if (saving_progress_) return SaveProgress(false, 0, {});
+    return true;
 }
 
 void InPlaceEncrypter::UpdateProgress(size_t blocks, bool done) {
+    std::lock_guard<std::mutex> lock(progress_lock_);
+
     // A log message already got printed for blocks_done_ if one was due, so the
     // next message will be due at the *next* block rounded up to kLogInterval.
     uint64_t blocks_next_msg = round_up(blocks_done_ + 1, kLogInterval);
@@ -128,49 +639,129 @@ void InPlaceEncrypter::UpdateProgress(size_t blocks, bool done) {
 
     if (blocks_done_ >= blocks_next_msg)
         LOG(DEBUG) << "Encrypted " << blocks_next_msg << " of " << blocks_to_encrypt_ << " blocks";
+
+    ReportProgress(done);
 }
 
-bool InPlaceEncrypter::EncryptPendingData() {
-    if (blocks_pending_ == 0) return true;
+// Passes the current progress to the caller's callback, if it's due.  This is
+// called with progress_lock_ held, so that the reports from parallel streams
+// are delivered in order; the callback therefore mustn't block for long.
+void InPlaceEncrypter::ReportProgress(bool force) {
+    if (!on_progress_) return;
 
-    ssize_t bytes = blocks_pending_ * block_size_;
-    uint64_t offset = first_pending_block_ * block_size_;
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed = now - last_report_time_;
+    if (!force && elapsed < kReportInterval) return;
 
-    if (pread64(realfd_, &io_buffer_[0], bytes, offset) != bytes) {
-        PLOG(ERROR) << "Error reading real_blkdev " << real_blkdev_ << " for inplace encrypt";
-        return false;
+    EncryptInPlaceProgress progress;
+    progress.blocks_done = blocks_done_;
+    progress.blocks_total = blocks_to_encrypt_;
+    progress.block_size = block_size_;
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    if (seconds > 0 && blocks_done_ > last_report_blocks_) {
+        double bytes_per_sec = (blocks_done_ - last_report_blocks_) * block_size_ / seconds;
+        progress.bytes_per_sec = bytes_per_sec;
+        // A forced report may come right after the previous one, so don't let
+        // its short interval skew the average.
+        if (avg_bytes_per_sec_ == 0)
+            avg_bytes_per_sec_ = bytes_per_sec;
+        else if (elapsed >= kReportInterval)
+            avg_bytes_per_sec_ += kThroughputWeight * (bytes_per_sec - avg_bytes_per_sec_);
     }
 
-    if (pwrite64(cryptofd_, &io_buffer_[0], bytes, offset) != bytes) {
-        PLOG(ERROR) << "Error writing crypto_blkdev " << crypto_blkdev_ << " for inplace encrypt";
-        return false;
+    if (blocks_done_ >= blocks_to_encrypt_) {
+        progress.eta = std::chrono::seconds(0);
+    } else if (avg_bytes_per_sec_ > 0) {
+        double remaining = (blocks_to_encrypt_ - blocks_done_) * block_size_;
+        progress.eta = std::chrono::seconds(static_cast<int64_t>(remaining / avg_bytes_per_sec_));
     }
 
-    UpdateProgress(blocks_pending_, false);
+    last_report_time_ = now;
+    last_report_blocks_ = blocks_done_;
+    on_progress_(progress);
+}
+
+bool InPlaceEncrypter::EncryptPendingData(InPlaceStream* stream) {
+    if (stream->blocks_pending == 0) return true;
 
-    blocks_pending_ = 0;
+    size_t bytes = stream->blocks_pending * block_size_;
+    uint64_t offset = stream->first_pending_block * block_size_;
+
+    if (!stream->io_queue.Submit(offset, bytes)) return false;
+
+    // Progress is counted when the data is queued rather than when it has been
+    // written, but any failure aborts the whole encryption anyway.
+    UpdateProgress(stream->blocks_pending, false);
+
+    stream->blocks_pending = 0;
+    return true;
+}
+
+// Encrypts the |num_blocks| used blocks starting at |first_block|.  Extents must
+// be given in increasing order.  If progress is being saved, they're collected
+// into windows, with the deferred blocks set aside until the end; otherwise
+// they go straight to the main stream.
+bool InPlaceEncrypter::ProcessUsedExtent(uint64_t first_block, uint64_t num_blocks) {
+    if (!saving_progress_) return ProcessUsedExtent(&stream_, first_block, num_blocks);
+
+    while (num_blocks > 0) {
+        while (next_deferred_range_ < deferred_ranges_.size()) {
+            const BlockExtent& range = deferred_ranges_[next_deferred_range_];
+            if (range.first_block + range.num_blocks > first_block) break;
+            next_deferred_range_++;
+        }
+        uint64_t count = num_blocks;
+        if (next_deferred_range_ < deferred_ranges_.size()) {
+            const BlockExtent& range = deferred_ranges_[next_deferred_range_];
+            if (range.first_block <= first_block) {
+                count = std::min(count, range.first_block + range.num_blocks - first_block);
+                append_extent(&deferred_extents_, first_block, count);
+                first_block += count;
+                num_blocks -= count;
+                continue;
+            }
+            count = std::min(count, range.first_block - first_block);
+        }
+        if (!AddToWindow(first_block, count)) return false;
+        first_block += count;
+        num_blocks -= count;
+    }
     return true;
 }
 
-bool InPlaceEncrypter::ProcessUsedBlock(uint64_t block_num) {
-    // Flush if the amount of pending data has reached the I/O buffer size, if
-    // there's a gap between the pending blocks and the next block (due to
-    // block(s) not being used by the filesystem and thus not needing
-    // encryption), or if the next block will be aligned to the I/O buffer size.
-    if (blocks_pending_ * block_size_ == io_buffer_.size() ||
-        block_num != first_pending_block_ + blocks_pending_ ||
-        (block_num * block_size_) % io_buffer_.size() == 0) {
-        if (!EncryptPendingData()) return false;
-        first_pending_block_ = block_num;
+// Adds the |num_blocks| used blocks starting at |first_block| to the pending
+// data, submitting it whenever an I/O buffer's worth has been collected.
+bool InPlaceEncrypter::ProcessUsedExtent(InPlaceStream* stream, uint64_t first_block,
+                                         uint64_t num_blocks) {
+    const uint64_t blocks_per_buffer = io_buffer_size_ / block_size_;
+
+    while (num_blocks > 0) {
+        // Flush if the amount of pending data has reached the I/O buffer size,
+        // if there's a gap between the pending blocks and the next block (due
+        // to block(s) not being used by the filesystem and thus not needing
+        // encryption), or if the next block will be aligned to the I/O buffer
+        // size.
+        if (stream->blocks_pending == blocks_per_buffer ||
+            first_block != stream->first_pending_block + stream->blocks_pending ||
+            first_block % blocks_per_buffer == 0) {
+            if (!EncryptPendingData(stream)) return false;
+            stream->first_pending_block = first_block;
+        }
+        // Take as many blocks as fit before the next aligned boundary.
+        uint64_t count =
+                std::min(num_blocks, blocks_per_buffer - (first_block % blocks_per_buffer));
+        stream->blocks_pending += count;
+        first_block += count;
+        num_blocks -= count;
     }
-    blocks_pending_++;
     return true;
 }
 
 // Reads the block bitmap for block group |group| into |buf|.
-bool InPlaceEncrypter::ReadExt4BlockBitmap(uint32_t group, uint8_t* buf) {
+bool InPlaceEncrypter::ReadExt4BlockBitmap(int fd, uint32_t group, uint8_t* buf) {
     uint64_t offset = (uint64_t)aux_info.bg_desc[group].bg_block_bitmap * info.block_size;
-    if (pread64(realfd_, buf, info.block_size, offset) != (ssize_t)info.block_size) {
+    if (pread64(fd, buf, info.block_size, offset) != (ssize_t)info.block_size) {
         PLOG(ERROR) << "Failed to read block bitmap for block group " << group;
         return false;
     }
@@ -193,6 +784,76 @@ uint32_t InPlaceEncrypter::NumBaseMetaBlocksInGroup(uint64_t group) {
     return 1 + aux_info.bg_desc_blocks;
 }
 
+// Encrypts each used block in block group |group|, using |bitmap| (which must
+// be info.block_size bytes) as scratch space for the group's block bitmap.  The
+// blocks go to |stream| if given, or else through the main ProcessUsedExtent().
+bool InPlaceEncrypter::EncryptExt4Group(InPlaceStream* stream, int realfd, uint32_t group,
+                                        uint8_t* bitmap) {
+    if (!ReadExt4BlockBitmap(realfd, group, bitmap)) return false;
+
+    auto process_extent = [&](uint64_t first_block, uint64_t num_blocks) {
+        if (stream) return ProcessUsedExtent(stream, first_block, num_blocks);
+        return ProcessUsedExtent(first_block, num_blocks);
+    };
+
+    uint64_t first_block_num = FirstBlockInGroup(group);
+    if (aux_info.bg_desc[group].bg_flags & EXT4_BG_BLOCK_UNINIT)
+        return process_extent(first_block_num, NumBaseMetaBlocksInGroup(group));
+
+    return for_each_set_bit_run(bitmap, NumBlocksInGroup(group),
+                                [&](uint32_t start, uint32_t count) {
+                                    return process_extent(first_block_num + start, count);
+                                });
+}
+
+// Worker thread for EncryptExt4GroupsInParallel().  Takes block groups from
+// |next_group| until there are none left or any worker has failed.
+void InPlaceEncrypter::EncryptExt4GroupsWorker(std::atomic<uint32_t>* next_group,
+                                               std::atomic<bool>* failed) {
+    android::base::unique_fd realfd(open64(real_blkdev_.c_str(), O_RDONLY | O_CLOEXEC));
+    if (realfd < 0) {
+        PLOG(ERROR) << "Error opening real_blkdev " << real_blkdev_ << " for inplace encrypt";
+        *failed = true;
+        return;
+    }
+    android::base::unique_fd cryptofd(open64(crypto_blkdev_.c_str(), O_WRONLY | O_CLOEXEC));
+    if (cryptofd < 0) {
+        PLOG(ERROR) << "Error opening crypto_blkdev " << crypto_blkdev_ << " for inplace encrypt";
+        *failed = true;
+        return;
+    }
+
+    // The worker threads already provide the parallelism, so each one just
+    // does its I/O synchronously.
+    InPlaceStream stream;
+    stream.io_queue.Init(realfd, cryptofd, real_blkdev_, crypto_blkdev_, io_buffer_size_, 1);
+
+    std::vector<uint8_t> block_bitmap(info.block_size);
+    while (!*failed) {
+        uint32_t group = (*next_group)++;
+        if (group >= aux_info.groups) break;
+        if (!EncryptExt4Group(&stream, realfd, group, &block_bitmap[0])) *failed = true;
+    }
+    if (!*failed && !EncryptPendingData(&stream)) *failed = true;
+
+    std::lock_guard<std::mutex> lock(progress_lock_);
+    stream.io_queue.AddStats(&stats_);
+}
+
+bool InPlaceEncrypter::EncryptExt4GroupsInParallel(unsigned int num_threads) {
+    LOG(DEBUG) << "Encrypting ext4 block groups using " << num_threads << " threads";
+
+    std::atomic<uint32_t> next_group(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < num_threads; i++) {
+        workers.emplace_back(&InPlaceEncrypter::EncryptExt4GroupsWorker, this, &next_group,
+                             &failed);
+    }
+    for (auto& worker : workers) worker.join();
+    return !failed;
+}
+
 EncryptInPlaceError InPlaceEncrypter::EncryptInPlaceExt4() {
     if (setjmp(setjmp_env))  // NOLINT
         return kFilesystemNotFound;
@@ -210,29 +871,72 @@ EncryptInPlaceError InPlaceEncrypter::EncryptInPlaceExt4() {
                     (NumBlocksInGroup(group) - aux_info.bg_desc[group].bg_free_blocks_count);
     }
 
-    InitFs("ext4", blocks_to_encrypt, aux_info.len_blocks, info.block_size);
+    // Block groups don't depend on each other, so they can be split across
+    // multiple threads if that has been enabled.  Progress can only be saved
+    // when they are encrypted in order, though.
+    unsigned int num_threads = android::base::GetUintProperty(kThreadsProp, 1u, kMaxThreads);
+    num_threads = std::min<uint32_t>(num_threads, aux_info.groups);
+    if (num_threads > 1 && resuming_) {
+        LOG(INFO) << "Not using multiple threads, since an interrupted encryption is resuming";
+        num_threads = 1;
+    }
+    if (num_threads > 1 && saving_progress_) {
+        LOG(WARNING) << "Not saving in-place encryption progress, since " << kThreadsProp
+                     << " is " << num_threads << "; if interrupted, it can't be resumed";
+        saving_progress_ = false;
+    }
+
+    // The superblock, group descriptors and block bitmaps are needed to find
+    // the used blocks, so if progress is saved they have to be encrypted last.
+    if (saving_progress_) {
+        append_extent(&deferred_ranges_, 0, aux_info.first_data_block + 1 + aux_info.bg_desc_blocks);
+        std::vector<uint64_t> bitmap_blocks;
+        for (uint32_t group = 0; group < aux_info.groups; group++)
+            bitmap_blocks.push_back(aux_info.bg_desc[group].bg_block_bitmap);
+        std::sort(bitmap_blocks.begin(), bitmap_blocks.end());
+        for (uint64_t block : bitmap_blocks) {
+            if (block >= deferred_ranges_.back().first_block + deferred_ranges_.back().num_blocks)
+                append_extent(&deferred_ranges_, block, 1);
+        }
+    }
+
+    if (!InitFs("ext4", blocks_to_encrypt, aux_info.len_blocks, info.block_size)) return kFailed;
+
+    if (num_threads > 1) {
+        return EncryptExt4GroupsInParallel(num_threads) ? kSuccess : kFailed;
+    }
 
     // Encrypt each block group.
     std::vector<uint8_t> block_bitmap(info.block_size);
     for (uint32_t group = 0; group < aux_info.groups; group++) {
-        if (!ReadExt4BlockBitmap(group, &block_bitmap[0])) return kFailed;
-
-        uint64_t first_block_num = FirstBlockInGroup(group);
-        bool uninit = (aux_info.bg_desc[group].bg_flags & EXT4_BG_BLOCK_UNINIT);
-        uint32_t block_count = uninit ? NumBaseMetaBlocksInGroup(group) : NumBlocksInGroup(group);
-
-        // Encrypt each used block in the block group.
-        for (uint32_t i = 0; i < block_count; i++) {
-            if (uninit || bitmap_get_bit(&block_bitmap[0], i))
-                ProcessUsedBlock(first_block_num + i);
-        }
+        if (!EncryptExt4Group(nullptr, realfd_, group, &block_bitmap[0])) return kFailed;
     }
     return kSuccess;
 }
 
-static int encrypt_f2fs_block(uint64_t block_num, void* _encrypter) {
-    InPlaceEncrypter* encrypter = reinterpret_cast<InPlaceEncrypter*>(_encrypter);
-    if (!encrypter->ProcessUsedBlock(block_num)) return -1;
+// run_on_used_blocks() reports used blocks one at a time.  Collect them into
+// extents so that the encrypter only gets called once per contiguous run.
+struct F2fsExtentCollector {
+    InPlaceEncrypter* encrypter;
+    uint64_t first_block = 0;
+    uint64_t num_blocks = 0;
+
+    bool Flush() {
+        if (num_blocks == 0) return true;
+        return encrypter->ProcessUsedExtent(first_block, num_blocks);
+    }
+};
+
+static int encrypt_f2fs_block(uint64_t block_num, void* _collector) {
+    F2fsExtentCollector* collector = reinterpret_cast<F2fsExtentCollector*>(_collector);
+    if (collector->num_blocks != 0 &&
+        block_num == collector->first_block + collector->num_blocks) {
+        collector->num_blocks++;
+        return 0;
+    }
+    if (!collector->Flush()) return -1;
+    collector->first_block = block_num;
+    collector->num_blocks = 1;
     return 0;
 }
 
@@ -241,14 +945,26 @@ EncryptInPlaceError InPlaceEncrypter::EncryptInPlaceF2fs() {
             generate_f2fs_info(realfd_), free_f2fs_info);
     if (!fs_info) return kFilesystemNotFound;
 
-    InitFs("f2fs", get_num_blocks_used(fs_info.get()), fs_info->total_blocks, fs_info->block_size);
-    if (run_on_used_blocks(0, fs_info.get(), encrypt_f2fs_block, this) != 0) return kFailed;
+    // The superblock, checkpoint and SIT are needed to find the used blocks, so
+    // if progress is saved they have to be encrypted last.
+    if (saving_progress_) append_extent(&deferred_ranges_, 0, fs_info->nat_blkaddr);
+
+    if (!InitFs("f2fs", get_num_blocks_used(fs_info.get()), fs_info->total_blocks,
+                fs_info->block_size))
+        return kFailed;
+    F2fsExtentCollector collector{this};
+    if (run_on_used_blocks(0, fs_info.get(), encrypt_f2fs_block, &collector) != 0) return kFailed;
+    if (!collector.Flush()) return kFailed;
     return kSuccess;
 }
 
 bool InPlaceEncrypter::DoEncryptInPlace() {
     EncryptInPlaceError rc;
 
+    // The filesystem metadata may already be partly encrypted, so it can't be
+    // read; all the blocks that are left are listed in the saved progress.
+    if (resume_deferred_) return ResumeDeferredWindow();
+
     rc = EncryptInPlaceExt4();
     if (rc != kFilesystemNotFound) return rc == kSuccess;
 
@@ -257,18 +973,292 @@ bool InPlaceEncrypter::DoEncryptInPlace() {
 
     LOG(WARNING) << "No recognized filesystem found on " << real_blkdev_
                  << ".  Falling back to encrypting the full block device.";
-    InitFs("", nr_sec_, nr_sec_, 512);
-    for (uint64_t i = 0; i < nr_sec_; i++) {
-        if (!ProcessUsedBlock(i)) return false;
+    if (!InitFs("", nr_sec_, nr_sec_, 512)) return false;
+    return ProcessUsedExtent(0, nr_sec_);
+}
+
+uint64_t InPlaceEncrypter::HashBlock(const uint8_t* data) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(data, block_size_, digest);
+    uint64_t hash;
+    memcpy(&hash, digest, sizeof(hash));
+    return hash;
+}
+
+bool InPlaceEncrypter::ReadBlockHash(int fd, uint64_t block, uint64_t* hash) {
+    std::vector<uint8_t> buf(block_size_);
+    if (pread64(fd, buf.data(), block_size_, block * block_size_) != (ssize_t)block_size_) {
+        PLOG(ERROR) << "Failed to read block " << block << " for inplace encrypt";
+        return false;
+    }
+    *hash = HashBlock(buf.data());
+    return true;
+}
+
+// Loads the progress saved by an interrupted encryption, if there is any.
+bool InPlaceEncrypter::LoadProgress() {
+    std::string contents;
+    if (!android::base::ReadFileToString(progress_path_, &contents)) {
+        if (errno == ENOENT) return true;
+        PLOG(ERROR) << "Failed to read " << progress_path_;
+        return false;
+    }
+    InPlaceProgressHeader header;
+    if (contents.size() < sizeof(header)) {
+        LOG(ERROR) << "In-place encryption progress file " << progress_path_ << " is truncated";
+        return false;
+    }
+    memcpy(&header, contents.data(), sizeof(header));
+    if (header.magic != kProgressMagic || header.version != kProgressVersion ||
+        header.num_entries > contents.size() / sizeof(ProgressEntry) ||
+        contents.size() != sizeof(header) + header.num_entries * sizeof(ProgressEntry)) {
+        LOG(ERROR) << "In-place encryption progress file " << progress_path_ << " is invalid";
+        return false;
+    }
+    if (header.nr_sec != nr_sec_) {
+        LOG(ERROR) << "In-place encryption progress file " << progress_path_ << " is for a "
+                   << header.nr_sec << "-sector device, but " << real_blkdev_ << " has "
+                   << nr_sec_ << " sectors";
+        return false;
+    }
+
+    resuming_ = true;
+    resume_fs_type_.assign(header.fs_type, strnlen(header.fs_type, sizeof(header.fs_type)));
+    resume_block_size_ = header.block_size;
+    resume_deferred_ = header.deferred != 0;
+    resume_block_ = header.resume_block;
+    resume_window_.resize(header.num_entries);
+    memcpy(resume_window_.data(), contents.data() + sizeof(header),
+           header.num_entries * sizeof(ProgressEntry));
+
+    LOG(INFO) << "Resuming interrupted in-place encryption of " << real_blkdev_ << " from "
+              << (resume_deferred_ ? "its final window" : "block " + std::to_string(resume_block_));
+    return true;
+}
+
+// Atomically replaces the progress file with one recording the next window.
+bool InPlaceEncrypter::SaveProgress(bool deferred, uint64_t resume_block,
+                                    std::vector<ProgressEntry> entries) {
+    // Blocks of the window that was interrupted which turned out to be already
+    // encrypted must stay listed until the resume point moves past them.
+    for (const auto& entry : resume_done_) {
+        if (entry.block >= resume_block) entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const ProgressEntry& a, const ProgressEntry& b) { return a.block < b.block; });
+
+    InPlaceProgressHeader header = {};
+    header.magic = kProgressMagic;
+    header.version = kProgressVersion;
+    strncpy(header.fs_type, fs_type_.c_str(), sizeof(header.fs_type));
+    header.nr_sec = nr_sec_;
+    header.block_size = block_size_;
+    header.deferred = deferred;
+    header.resume_block = resume_block;
+    header.num_entries = entries.size();
+
+    std::string contents(reinterpret_cast<const char*>(&header), sizeof(header));
+    contents.append(reinterpret_cast<const char*>(entries.data()),
+                    entries.size() * sizeof(ProgressEntry));
+
+    std::string tmp_path = progress_path_ + ".tmp";
+    if (!android::vold::writeStringToFile(contents, tmp_path)) return false;
+    if (rename(tmp_path.c_str(), progress_path_.c_str()) != 0) {
+        PLOG(ERROR) << "Unable to move " << tmp_path << " to " << progress_path_;
+        return false;
+    }
+    return android::vold::FsyncParentDirectory(progress_path_);
+}
+
+bool InPlaceEncrypter::RemoveProgress() {
+    if (unlink(progress_path_.c_str()) != 0 && errno != ENOENT) {
+        PLOG(ERROR) << "Failed to remove " << progress_path_;
+        return false;
+    }
+    return android::vold::FsyncParentDirectory(progress_path_);
+}
+
+// Works out which blocks of the interrupted window were already encrypted, by
+// comparing each block's contents with the saved hash of its original contents.
+bool InPlaceEncrypter::FindAlreadyEncryptedBlocks() {
+    android::base::unique_fd crypto_readfd(open64(crypto_blkdev_.c_str(), O_RDONLY | O_CLOEXEC));
+    if (crypto_readfd < 0) {
+        PLOG(ERROR) << "Error opening crypto_blkdev " << crypto_blkdev_ << " for inplace encrypt";
+        return false;
+    }
+    for (const auto& entry : resume_window_) {
+        uint64_t hash;
+        if (!ReadBlockHash(realfd_, entry.block, &hash)) return false;
+        if (hash == entry.hash) continue;
+        if (!ReadBlockHash(crypto_readfd, entry.block, &hash)) return false;
+        if (hash != entry.hash) {
+            LOG(ERROR) << "Block " << entry.block << " of " << real_blkdev_
+                       << " matches neither its original nor its encrypted contents; unable to "
+                          "resume in-place encryption";
+            return false;
+        }
+        resume_done_.push_back(entry);
+    }
+    LOG(INFO) << resume_done_.size() << " of the " << resume_window_.size()
+              << " blocks in the interrupted window were already encrypted";
+    return true;
+}
+
+// Adds used blocks (none of them deferred) to the next window, skipping those
+// that an interrupted encryption already did, and commits the window once it's
+// full.
+bool InPlaceEncrypter::AddToWindow(uint64_t first_block, uint64_t num_blocks) {
+    const uint64_t max_window_blocks = std::min(kProgressInterval / block_size_, kMaxProgressEntries);
+
+    while (num_blocks > 0) {
+        uint64_t count;
+        auto done = std::lower_bound(resume_done_.begin(), resume_done_.end(), first_block,
+                                     entry_block_less);
+        if (first_block < resume_block_) {
+            count = std::min(num_blocks, resume_block_ - first_block);
+            UpdateProgress(count, false);
+        } else if (done != resume_done_.end() && done->block == first_block) {
+            count = 1;
+            UpdateProgress(count, false);
+        } else {
+            count = std::min(num_blocks, max_window_blocks - window_blocks_);
+            if (done != resume_done_.end()) count = std::min(count, done->block - first_block);
+            append_extent(&window_, first_block, count);
+            window_blocks_ += count;
+            if (window_blocks_ == max_window_blocks && !CommitWindow(false)) return false;
+        }
+        first_block += count;
+        num_blocks -= count;
+    }
+    return true;
+}
+
+// Saves the hashes of the blocks in the window, then starts encrypting them.
+//
+// The window is read into window_data_ to hash it, and then encrypted by
+// writing that same data to the crypto device.  Those writes are left in
+// flight while the next window is collected, read and hashed; only saving the
+// next window's progress has to wait for them to be synced.  The deferred
+// window of a very large filesystem can be too big to hold in memory; it's
+// hashed a part at a time and then read again to encrypt it, but it's only
+// filesystem metadata.
+bool InPlaceEncrypter::CommitWindow(bool deferred) {
+    if (window_.empty() && !deferred) return true;
+
+    uint64_t num_blocks = 0;
+    for (const auto& extent : window_) num_blocks += extent.num_blocks;
+    const uint64_t max_data_blocks = kProgressInterval / block_size_;
+    const uint64_t blocks_per_io = io_buffer_size_ / block_size_;
+    const bool fits = num_blocks <= max_data_blocks;
+    window_data_.resize(std::min(num_blocks, max_data_blocks) * block_size_);
+
+    // Reads go through the I/O queue, so several are in flight at once.  The
+    // blocks read since the last hashing pass are entries[hashed...].
+    std::vector<ProgressEntry> entries;
+    size_t hashed = 0;
+    auto hash_data = [&]() {
+        if (!stream_.io_queue.Drain()) return false;
+        for (size_t i = hashed; i < entries.size(); i++) {
+            entries[i].hash = HashBlock(&window_data_[(i - hashed) * block_size_]);
+        }
+        hashed = entries.size();
+        return true;
+    };
+    for (const auto& extent : window_) {
+        for (uint64_t i = 0; i < extent.num_blocks;) {
+            if (entries.size() - hashed == max_data_blocks && !hash_data()) return false;
+            uint64_t block = extent.first_block + i;
+            uint64_t count = std::min({extent.num_blocks - i, blocks_per_io,
+                                       max_data_blocks - (entries.size() - hashed)});
+            if (!stream_.io_queue.SubmitRead(block * block_size_, count * block_size_,
+                                             &window_data_[(entries.size() - hashed) * block_size_]))
+                return false;
+            for (uint64_t j = 0; j < count; j++) entries.push_back({block + j, 0});
+            i += count;
+        }
+    }
+    if (!hash_data()) return false;
+
+    // The saved progress no longer covers the previous window's blocks.
+    if (!SyncWindowWrites()) return false;
+    uint64_t resume_block = window_.empty() ? 0 : window_.front().first_block;
+    if (!SaveProgress(deferred, deferred ? 0 : resume_block, std::move(entries))) return false;
+
+    if (fits) {
+        const uint8_t* data = window_data_.data();
+        for (const auto& extent : window_) {
+            for (uint64_t i = 0; i < extent.num_blocks;) {
+                uint64_t count = std::min(extent.num_blocks - i, blocks_per_io);
+                if (!window_writes_.SubmitWrite((extent.first_block + i) * block_size_,
+                                                count * block_size_, data))
+                    return false;
+                UpdateProgress(count, false);
+                data += count * block_size_;
+                i += count;
+            }
+        }
+        // The next window is read into the other buffer.
+        std::swap(window_data_, writing_data_);
+    } else {
+        for (const auto& extent : window_) {
+            if (!ProcessUsedExtent(&stream_, extent.first_block, extent.num_blocks)) return false;
+        }
+        if (!EncryptPendingData(&stream_)) return false;
+    }
+    writes_unsynced_ = true;
+    window_.clear();
+    window_blocks_ = 0;
+    return true;
+}
+
+// Waits for the writes of the last committed window and syncs them.
+bool InPlaceEncrypter::SyncWindowWrites() {
+    if (!writes_unsynced_) return true;
+    if (!window_writes_.Drain() || !stream_.io_queue.Drain()) return false;
+    if (fsync(cryptofd_) != 0) {
+        PLOG(ERROR) << "Error syncing " << crypto_blkdev_;
+        return false;
+    }
+    writes_unsynced_ = false;
+    return true;
+}
+
+// Encrypts the last partial window, then the deferred filesystem metadata.
+bool InPlaceEncrypter::CommitDeferredWindow() {
+    if (!CommitWindow(false)) return false;
+    // Once the main pass has finished, no earlier window's entries are needed.
+    if (!resume_deferred_) resume_done_.clear();
+    window_ = std::move(deferred_extents_);
+    return CommitWindow(true);
+}
+
+bool InPlaceEncrypter::ResumeDeferredWindow() {
+    if (!InitFs(resume_fs_type_, resume_window_.size(), resume_window_.size(),
+                resume_block_size_))
+        return false;
+    size_t done = 0;
+    for (const auto& entry : resume_window_) {
+        if (done < resume_done_.size() && resume_done_[done].block == entry.block) {
+            done++;
+            UpdateProgress(1, false);
+            continue;
+        }
+        append_extent(&deferred_extents_, entry.block, 1);
     }
     return true;
 }
 
 bool InPlaceEncrypter::EncryptInPlace(const std::string& crypto_blkdev,
-                                      const std::string& real_blkdev, uint64_t nr_sec) {
+                                      const std::string& real_blkdev, uint64_t nr_sec,
+                                      const std::string& progress_path,
+                                      const EncryptInPlaceProgressCallback& on_progress) {
     real_blkdev_ = real_blkdev;
     crypto_blkdev_ = crypto_blkdev;
     nr_sec_ = nr_sec;
+    progress_path_ = progress_path;
+    saving_progress_ = !progress_path.empty();
+    on_progress_ = on_progress;
+    auto start_time = std::chrono::steady_clock::now();
 
     realfd_.reset(open64(real_blkdev.c_str(), O_RDONLY | O_CLOEXEC));
     if (realfd_ < 0) {
@@ -282,19 +1272,38 @@ bool InPlaceEncrypter::EncryptInPlace(const std::string& crypto_blkdev,
         return false;
     }
 
+    if (saving_progress_) {
+        if (!android::vold::MkdirsSync(progress_path_, 0700)) return false;
+        if (!LoadProgress()) return false;
+    }
+
     bool success = DoEncryptInPlace();
 
-    if (success) success &= EncryptPendingData();
+    if (success && saving_progress_) success &= CommitDeferredWindow();
+
+    if (success) success &= EncryptPendingData(&stream_);
+
+    // Wait for all queued I/O to finish, even on failure, before the final sync.
+    success &= stream_.io_queue.Drain();
+    success &= window_writes_.Drain();
 
+    // This also syncs data written through the parallel ext4 workers' fds, as
+    // they all refer to the same block device.
     if (success && fsync(cryptofd_) != 0) {
         PLOG(ERROR) << "Error syncing " << crypto_blkdev_;
         success = false;
     }
 
+    stream_.io_queue.AddStats(&stats_);
+    window_writes_.AddStats(&stats_);
+    stats_.bytes_encrypted = blocks_done_ * block_size_;
+    stats_.total_time = std::chrono::steady_clock::now() - start_time;
+
     if (!success) {
         LOG(ERROR) << "In-place encryption of " << DescribeFilesystem() << " failed";
         return false;
     }
+    if (saving_progress_ && !RemoveProgress()) return false;
     if (blocks_done_ != blocks_to_encrypt_) {
         LOG(WARNING) << "blocks_to_encrypt (" << blocks_to_encrypt_
                      << ") was incorrect; we actually encrypted " << blocks_done_
@@ -314,11 +1323,30 @@ bool InPlaceEncrypter::EncryptInPlace(const std::string& crypto_blkdev,
 // device backed by |real_blkdev|.  The size to encrypt is |nr_sec| 512-byte
 // sectors; however, if a filesystem is detected, then its size will be used
 // instead, and only the in-use blocks of the filesystem will be encrypted.
+//
+// If |progress_path| is non-empty, progress is saved to that file as the
+// encryption goes along, so that if it is interrupted (e.g. by power loss), it
+// can be resumed by calling this again with the same arguments.  The file is
+// removed once the encryption has completed.
+//
+// If |stats| is non-null, statistics about the encryption are returned in it.
+//
+// If |on_progress| is set, it's called with the progress of the encryption
+// about once per second while it runs, possibly from another thread.
 bool encrypt_inplace(const std::string& crypto_blkdev, const std::string& real_blkdev,
-                     uint64_t nr_sec) {
+                     uint64_t nr_sec, const std::string& progress_path,
+                     EncryptInPlaceStats* stats, const EncryptInPlaceProgressCallback& on_progress) {
     LOG(DEBUG) << "encrypt_inplace(" << crypto_blkdev << ", " << real_blkdev << ", " << nr_sec
-               << ")";
+               << ", " << progress_path << ")";
 
     InPlaceEncrypter encrypter;
-    return encrypter.EncryptInPlace(crypto_blkdev, real_blkdev, nr_sec);
+    bool success = encrypter.EncryptInPlace(crypto_blkdev, real_blkdev, nr_sec, progress_path,
+                                             on_progress);
+    if (stats) *stats = encrypter.stats();
+    return success;
+}
+
+// Returns true if |progress_path| records an interrupted in-place encryption.
+bool encrypt_inplace_interrupted(const std::string& progress_path) {
+    return android::vold::pathExists(progress_path);
 }
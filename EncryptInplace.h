@@ -18,9 +18,40 @@
 #define _ENCRYPT_INPLACE_H
 
 #include <stdint.h>
+#include <chrono>
+#include <functional>
 #include <string>
 
+// Statistics about an in-place encryption, for benchmarking.
+struct EncryptInPlaceStats {
+    uint64_t bytes_encrypted = 0;
+    uint64_t read_calls = 0;
+    uint64_t write_calls = 0;
+    // Time that the thread(s) finding the used blocks spent waiting for I/O,
+    // summed over all threads.  The rest of the time went to scanning.
+    std::chrono::nanoseconds io_wait_time{0};
+    std::chrono::nanoseconds total_time{0};
+};
+
+// A snapshot of the progress of an in-place encryption, for reporting it to
+// the user while it runs.
+struct EncryptInPlaceProgress {
+    uint64_t blocks_done = 0;
+    uint64_t blocks_total = 0;
+    unsigned int block_size = 0;
+    // Throughput since the previous report.
+    uint64_t bytes_per_sec = 0;
+    // Estimated time remaining, or -1 if it isn't known yet.
+    std::chrono::seconds eta{-1};
+};
+
+using EncryptInPlaceProgressCallback = std::function<void(const EncryptInPlaceProgress&)>;
+
 bool encrypt_inplace(const std::string& crypto_blkdev, const std::string& real_blkdev,
-                     uint64_t nr_sec);
+                     uint64_t nr_sec, const std::string& progress_path = "",
+                     EncryptInPlaceStats* stats = nullptr,
+                     const EncryptInPlaceProgressCallback& on_progress = nullptr);
+
+bool encrypt_inplace_interrupted(const std::string& progress_path);
 
 #endif
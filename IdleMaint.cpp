@@ -21,16 +21,23 @@
 #include "VolumeManager.h"
 #include "model/PrivateVolume.h"
 
+#include <algorithm>
+#include <array>
+#include <map>
+#include <mutex>
 #include <thread>
 #include <utility>
+#include <vector>
 
 #include <aidl/android/hardware/health/storage/BnGarbageCollectCallback.h>
 #include <aidl/android/hardware/health/storage/IStorage.h>
 #include <android-base/chrono_utils.h>
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <android/binder_manager.h>
 #include <android/hardware/health/storage/1.0/IStorage.h>
 #include <fs_mgr.h>
@@ -39,8 +46,11 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -77,6 +87,10 @@ enum class IdleMaintStats {
 
 static const char* kWakeLock = "IdleMaint";
 static const int DIRTY_SEGMENTS_THRESHOLD = 100;
+// GC is sampled this often, and given up on a device once this many samples in
+// a row find no fewer dirty segments there.
+static const int GC_SAMPLE_PERIOD_SEC = 5;
+static const int GC_STALLED_SAMPLES = 3;
 /*
  * Timing policy:
  *  1. F2FS_GC = 7 mins
@@ -84,11 +98,17 @@ static const int DIRTY_SEGMENTS_THRESHOLD = 100;
  *  3. Dev GC = 2 mins
  */
 static const int GC_TIMEOUT_SEC = 420;
+static const int TRIM_TIMEOUT_SEC = 60;
 static const int DEVGC_TIMEOUT_SEC = 120;
 static const int KBYTES_IN_SEGMENT = 2048;
 static const int ONE_MINUTE_IN_MS = 60000;
 static const int GC_NORMAL_MODE = 0;
 static const int GC_URGENT_MID_MODE = 3;
+static const int GC_PACE_SAMPLE_SEC = 60;
+// A day of storage telemetry.
+static const int TELEMETRY_SAMPLE_PERIOD_SEC = 600;
+static const size_t TELEMETRY_HISTORY_SIZE = 144;
+static const size_t WRITE_ACCOUNTING_MAX_CONSUMERS = 32;
 
 static int32_t previousSegmentWrite = 0;
 
@@ -96,6 +116,29 @@ static IdleMaintStats idle_maint_stat(IdleMaintStats::kStopped);
 static std::condition_variable cv_abort, cv_stop;
 static std::mutex cv_m;
 
+/*
+ * Incremental trim walks each filesystem a chunk at a time, sizing each chunk
+ * to take about TRIM_CHUNK_MS at the rate the last one went, so that an abort
+ * is noticed soon.  Where it got to is saved so that the next idle maintenance
+ * carries on from there.
+ */
+static const char* kTrimCursorsPath = "/data/misc/vold/trim_cursors";
+static const int TRIM_CHUNK_MS = 1000;
+static const uint64_t MIN_TRIM_CHUNK_BYTES = 64ULL << 20;
+static const uint64_t MAX_TRIM_CHUNK_BYTES = 64ULL << 30;
+static const uint64_t INITIAL_TRIM_CHUNK_BYTES = 1ULL << 30;
+
+struct TrimCursor {
+    uint64_t offset = 0;
+    uint64_t chunk_bytes = INITIAL_TRIM_CHUNK_BYTES;
+};
+
+struct IncrementalTrim {
+    std::chrono::steady_clock::time_point deadline;
+    std::mutex lock;
+    std::map<std::string, TrimCursor> cursors;
+};
+
 static void addFromVolumeManager(std::list<std::string>* paths, PathTypes path_type) {
     VolumeManager* vm = VolumeManager::Instance();
     std::list<std::string> privateIds;
@@ -163,7 +206,196 @@ static void addFromFstab(std::list<std::string>* paths, PathTypes path_type, boo
     }
 }
 
-void Trim(const android::sp<android::os::IVoldTaskListener>& listener) {
+static bool isIdleMaintAborted() {
+    std::lock_guard<std::mutex> lk(cv_m);
+    return idle_maint_stat == IdleMaintStats::kAbort;
+}
+
+// Loads the saved trim cursors of |paths|.
+static void loadTrimCursors(const std::list<std::string>& paths,
+                            std::map<std::string, TrimCursor>* cursors) {
+    std::string contents;
+    if (!ReadFileToString(kTrimCursorsPath, &contents)) {
+        if (errno != ENOENT) PLOG(WARNING) << "Failed to read " << kTrimCursorsPath;
+        return;
+    }
+    for (const auto& line : android::base::Split(contents, "\n")) {
+        auto fields = android::base::Split(line, " ");
+        TrimCursor cursor;
+        if (fields.size() != 3 || !android::base::ParseUint(fields[1], &cursor.offset) ||
+            !android::base::ParseUint(fields[2], &cursor.chunk_bytes)) {
+            continue;
+        }
+        if (std::find(paths.begin(), paths.end(), fields[0]) == paths.end()) continue;
+        cursor.chunk_bytes =
+                std::clamp(cursor.chunk_bytes, MIN_TRIM_CHUNK_BYTES, MAX_TRIM_CHUNK_BYTES);
+        (*cursors)[fields[0]] = cursor;
+    }
+}
+
+static void saveTrimCursors(const std::map<std::string, TrimCursor>& cursors) {
+    std::string contents;
+    for (const auto& [path, cursor] : cursors) {
+        contents += StringPrintf("%s %" PRIu64 " %" PRIu64 "\n", path.c_str(), cursor.offset,
+                                 cursor.chunk_bytes);
+    }
+    if (!WriteStringToFile(contents, kTrimCursorsPath)) {
+        PLOG(WARNING) << "Failed to write " << kTrimCursorsPath;
+    }
+}
+
+// Trims the filesystem open as |fd| a chunk at a time from |cursor|, until the
+// end, the deadline or an abort.  Adds up the bytes trimmed in |trimmed|.
+static bool trimIncrementally(int fd, const std::string& path, const IncrementalTrim& incremental,
+                              TrimCursor* cursor, uint64_t* trimmed) {
+    struct statvfs sv;
+    if (fstatvfs(fd, &sv) != 0) {
+        PLOG(WARNING) << "Failed to statvfs " << path;
+        return false;
+    }
+    uint64_t fs_bytes = static_cast<uint64_t>(sv.f_blocks) * sv.f_frsize;
+
+    for (;;) {
+        if (std::chrono::steady_clock::now() >= incremental.deadline || isIdleMaintAborted()) {
+            LOG(INFO) << "Stopped trimming " << path << " at " << cursor->offset;
+            return true;
+        }
+
+        // The last chunk goes all the way to the end, whatever the filesystem
+        // doesn't count in its size.
+        bool last = cursor->offset + cursor->chunk_bytes >= fs_bytes;
+        struct fstrim_range range;
+        memset(&range, 0, sizeof(range));
+        range.start = cursor->offset;
+        range.len = last ? ULLONG_MAX : cursor->chunk_bytes;
+
+        auto start = std::chrono::steady_clock::now();
+        if (ioctl(fd, FITRIM, &range)) {
+            // The saved cursor may be past the end if the filesystem changed.
+            if (errno == EINVAL && cursor->offset != 0) {
+                LOG(WARNING) << "Trim cursor " << cursor->offset << " is invalid for " << path;
+                cursor->offset = 0;
+                continue;
+            }
+            PLOG(WARNING) << "Trim failed on " << path << " at " << cursor->offset;
+            return false;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        *trimmed += range.len;
+
+        if (last) {
+            cursor->offset = 0;
+            return true;
+        }
+        cursor->offset += cursor->chunk_bytes;
+
+        // Size the next chunk to take about TRIM_CHUNK_MS at the rate this one
+        // went, without changing too much at once.
+        double ms = std::max(std::chrono::duration<double, std::milli>(elapsed).count(), 1.0);
+        uint64_t next = static_cast<uint64_t>(cursor->chunk_bytes * (TRIM_CHUNK_MS / ms));
+        next = std::clamp(next, cursor->chunk_bytes / 4, cursor->chunk_bytes * 4);
+        next = std::clamp(next, MIN_TRIM_CHUNK_BYTES, MAX_TRIM_CHUNK_BYTES);
+        cursor->chunk_bytes = next & ~(MIN_TRIM_CHUNK_BYTES - 1);
+    }
+}
+
+static void trimPath(const std::string& path,
+                     const android::sp<android::os::IVoldTaskListener>& listener,
+                     IncrementalTrim* incremental) {
+    LOG(DEBUG) << "Starting trim of " << path;
+
+    android::os::PersistableBundle extras;
+    extras.putString(String16("path"), String16(path.c_str()));
+
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        PLOG(WARNING) << "Failed to open " << path;
+        if (listener) {
+            listener->onStatus(-1, extras);
+        }
+        return;
+    }
+
+    nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
+    uint64_t trimmed = 0;
+    bool success;
+    if (incremental) {
+        TrimCursor cursor;
+        {
+            std::lock_guard<std::mutex> lock(incremental->lock);
+            cursor = incremental->cursors[path];
+        }
+        success = trimIncrementally(fd, path, *incremental, &cursor, &trimmed);
+        std::lock_guard<std::mutex> lock(incremental->lock);
+        incremental->cursors[path] = cursor;
+        saveTrimCursors(incremental->cursors);
+    } else {
+        struct fstrim_range range;
+        memset(&range, 0, sizeof(range));
+        range.len = ULLONG_MAX;
+
+        success = ioctl(fd, FITRIM, &range) == 0;
+        if (!success) {
+            PLOG(WARNING) << "Trim failed on " << path;
+        }
+        trimmed = range.len;
+    }
+
+    if (!success) {
+        if (listener) {
+            listener->onStatus(-1, extras);
+        }
+    } else {
+        nsecs_t time = systemTime(SYSTEM_TIME_BOOTTIME) - start;
+        LOG(INFO) << "Trimmed " << trimmed << " bytes on " << path << " in "
+                  << nanoseconds_to_milliseconds(time) << "ms";
+        extras.putLong(String16("bytes"), trimmed);
+        extras.putLong(String16("time"), time);
+        if (listener) {
+            listener->onStatus(0, extras);
+        }
+    }
+    close(fd);
+}
+
+// Returns the name of the disk that the filesystem mounted at |path| is stored
+// on, following device-mapper devices down to the devices they're stacked on,
+// and partitions up to their disk.  Returns |path| itself if that can't be
+// worked out, so that it gets a group of its own.
+static std::string getBackingDisk(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return path;
+    }
+    std::string dev_path;
+    if (!Realpath(StringPrintf("/sys/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev)),
+                  &dev_path)) {
+        return path;
+    }
+
+    // Stacked devices list what they're on in slaves/.  A device stacked on
+    // several is grouped with the first of them.
+    for (int depth = 0; depth < 8; depth++) {
+        auto dirp = std::unique_ptr<DIR, int (*)(DIR*)>(opendir((dev_path + "/slaves").c_str()),
+                                                        closedir);
+        if (!dirp) break;
+        std::string slave;
+        struct dirent* ent;
+        while ((ent = readdir(dirp.get())) != nullptr) {
+            if (ent->d_name[0] == '.') continue;
+            if (slave.empty() || slave > ent->d_name) slave = ent->d_name;
+        }
+        if (slave.empty() || !Realpath(dev_path + "/slaves/" + slave, &dev_path)) break;
+    }
+
+    // A partition's directory is inside its disk's.
+    if (access((dev_path + "/partition").c_str(), F_OK) == 0) {
+        dev_path = android::base::Dirname(dev_path);
+    }
+    return Basename(dev_path);
+}
+
+void Trim(const android::sp<android::os::IVoldTaskListener>& listener, bool incremental) {
     auto wl = android::wakelock::WakeLock::tryGet(kWakeLock);
     if (!wl.has_value()) {
         return;
@@ -174,71 +406,157 @@ void Trim(const android::sp<android::os::IVoldTaskListener>& listener) {
     addFromFstab(&paths, PathTypes::kMountPoint, false);
     addFromVolumeManager(&paths, PathTypes::kMountPoint);
 
+    std::unique_ptr<IncrementalTrim> incremental_trim;
+    if (incremental) {
+        incremental_trim = std::make_unique<IncrementalTrim>();
+        incremental_trim->deadline =
+                std::chrono::steady_clock::now() + std::chrono::seconds(TRIM_TIMEOUT_SEC);
+        loadTrimCursors(paths, &incremental_trim->cursors);
+    }
+
+    // Discards on the same disk would only queue up behind each other, but
+    // different disks can be trimmed at the same time.  Keep the paths in
+    // order within each disk.
+    std::vector<std::pair<std::string, std::list<std::string>>> groups;
     for (const auto& path : paths) {
-        LOG(DEBUG) << "Starting trim of " << path;
+        std::string disk = getBackingDisk(path);
+        auto it = std::find_if(groups.begin(), groups.end(),
+                               [&](const auto& group) { return group.first == disk; });
+        if (it == groups.end()) {
+            groups.emplace_back(disk, std::list<std::string>());
+            it = std::prev(groups.end());
+        }
+        it->second.push_back(path);
+    }
 
+    auto trimGroup = [&](const std::list<std::string>& group_paths) {
+        for (const auto& path : group_paths) {
+            trimPath(path, listener, incremental_trim.get());
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < groups.size(); i++) {
+        LOG(DEBUG) << "Trimming " << groups[i].first << " in parallel";
+        threads.emplace_back(trimGroup, std::cref(groups[i].second));
+    }
+    if (!groups.empty()) {
+        trimGroup(groups[0].second);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (listener) {
         android::os::PersistableBundle extras;
-        extras.putString(String16("path"), String16(path.c_str()));
+        listener->onFinished(0, extras);
+    }
 
-        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
-        if (fd < 0) {
-            PLOG(WARNING) << "Failed to open " << path;
-            if (listener) {
-                listener->onStatus(-1, extras);
+}
+
+// Follows how far f2fs GC has got on each device from its dirty_segments, so
+// that GC can be stopped on each one as soon as it has done what it can,
+// rather than when they all have.
+class GcTracker {
+  public:
+    explicit GcTracker(const std::list<std::string>& paths) {
+        for (const auto& path : paths) {
+            Device device;
+            device.path = path;
+            device.dirty_segments_fd.reset(
+                    open((path + "/dirty_segments").c_str(), O_RDONLY | O_CLOEXEC));
+            if (device.dirty_segments_fd < 0) {
+                PLOG(WARNING) << "Opening dirty_segments failed in " << path;
+                device.done = true;
             }
-            continue;
+            devices_.push_back(std::move(device));
         }
+    }
 
-        struct fstrim_range range;
-        memset(&range, 0, sizeof(range));
-        range.len = ULLONG_MAX;
-
-        nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
-        if (ioctl(fd, FITRIM, &range)) {
-            PLOG(WARNING) << "Trim failed on " << path;
-            if (listener) {
-                listener->onStatus(-1, extras);
+    // Samples the devices still being collected, stops GC on those that are
+    // done and reports them all to |listener|.  Returns whether all are done.
+    bool update(const android::sp<android::os::IVoldTaskListener>& listener) {
+        bool all_done = true;
+        for (auto& device : devices_) {
+            if (device.done) continue;
+            sample(&device);
+            if (device.done) {
+                LOG(INFO) << "GC on " << device.path << " reclaimed "
+                          << device.initial - device.dirty << " segments, "
+                          << device.dirty << " left dirty";
+                if (!WriteStringToFile("0", device.path + "/gc_urgent")) {
+                    PLOG(WARNING) << "Stop GC failed on " << device.path;
+                }
+            } else {
+                all_done = false;
             }
-        } else {
-            nsecs_t time = systemTime(SYSTEM_TIME_BOOTTIME) - start;
-            LOG(INFO) << "Trimmed " << range.len << " bytes on " << path << " in "
-                      << nanoseconds_to_milliseconds(time) << "ms";
-            extras.putLong(String16("bytes"), range.len);
-            extras.putLong(String16("time"), time);
+
             if (listener) {
+                android::os::PersistableBundle extras;
+                extras.putString(String16("path"), String16(device.path.c_str()));
+                extras.putInt(String16("dirty_segments"), device.dirty);
+                extras.putInt(String16("reclaimed_segments"), device.initial - device.dirty);
+                extras.putDouble(String16("reclaim_rate"), device.reclaim_rate);
+                extras.putBoolean(String16("done"), device.done);
                 listener->onStatus(0, extras);
             }
         }
-        close(fd);
+        return all_done;
     }
 
-    if (listener) {
-        android::os::PersistableBundle extras;
-        listener->onFinished(0, extras);
+  private:
+    struct Device {
+        std::string path;
+        android::base::unique_fd dirty_segments_fd;
+        int32_t initial = -1;
+        int32_t dirty = -1;
+        std::chrono::steady_clock::time_point time;
+        // Segments per second, smoothed over the samples.
+        double reclaim_rate = 0;
+        int samples = 0;
+        // How many samples in a row haven't found fewer dirty segments.
+        int stalled = 0;
+        bool done = false;
+    };
+
+    void sample(Device* device) {
+        char buf[32];
+        ssize_t n = pread(device->dirty_segments_fd, buf, sizeof(buf), 0);
+        int32_t dirty;
+        if (n <= 0 || !android::base::ParseInt(android::base::Trim(std::string(buf, n)), &dirty)) {
+            PLOG(WARNING) << "Reading dirty_segments failed in " << device->path;
+            device->done = true;
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (device->initial < 0) {
+            device->initial = dirty;
+        } else {
+            double seconds = std::chrono::duration<double>(now - device->time).count();
+            double rate = seconds > 0 ? (device->dirty - dirty) / seconds : 0;
+            device->reclaim_rate =
+                    device->samples == 1 ? rate : (rate + device->reclaim_rate) / 2;
+            device->stalled = dirty < device->dirty ? 0 : device->stalled + 1;
+        }
+        device->dirty = dirty;
+        device->time = now;
+        device->samples++;
+
+        device->done = dirty <= DIRTY_SEGMENTS_THRESHOLD || device->stalled >= GC_STALLED_SAMPLES;
     }
 
-}
+    std::vector<Device> devices_;
+};
 
-static bool waitForGc(const std::list<std::string>& paths) {
+static bool waitForGc(const std::list<std::string>& paths,
+                      const android::sp<android::os::IVoldTaskListener>& listener) {
     std::unique_lock<std::mutex> lk(cv_m, std::defer_lock);
-    bool stop = false, aborted = false;
+    bool aborted = false;
     Timer timer;
+    GcTracker tracker(paths);
 
-    while (!stop && !aborted) {
-        stop = true;
-        for (const auto& path : paths) {
-            std::string dirty_segments;
-            if (!ReadFileToString(path + "/dirty_segments", &dirty_segments)) {
-                PLOG(WARNING) << "Reading dirty_segments failed in " << path;
-                continue;
-            }
-            if (std::stoi(dirty_segments) > DIRTY_SEGMENTS_THRESHOLD) {
-                stop = false;
-                break;
-            }
-        }
-
-        if (stop) break;
+    while (!aborted) {
+        if (tracker.update(listener)) break;
 
         if (timer.duration() >= std::chrono::seconds(GC_TIMEOUT_SEC)) {
             LOG(WARNING) << "GC timeout";
@@ -246,8 +564,8 @@ static bool waitForGc(const std::list<std::string>& paths) {
         }
 
         lk.lock();
-        aborted =
-            cv_abort.wait_for(lk, 10s, [] { return idle_maint_stat == IdleMaintStats::kAbort; });
+        aborted = cv_abort.wait_for(lk, std::chrono::seconds(GC_SAMPLE_PERIOD_SEC),
+                                    [] { return idle_maint_stat == IdleMaintStats::kAbort; });
         lk.unlock();
     }
 
@@ -422,14 +740,16 @@ int RunIdleMaint(bool needGC, const android::sp<android::os::IVoldTaskListener>&
 
         startGc(paths);
 
-        gc_aborted = waitForGc(paths);
+        gc_aborted = waitForGc(paths, listener);
 
         stopGc(paths);
     }
 
     if (!gc_aborted) {
-        Trim(nullptr);
-        runDevGc();
+        Trim(nullptr, true);
+        if (!isIdleMaintAborted()) {
+            runDevGc();
+        }
     }
 
     lk.lock();
@@ -475,31 +795,193 @@ int AbortIdleMaint(const android::sp<android::os::IVoldTaskListener>& listener)
     return android::OK;
 }
 
-int getLifeTime(const std::string& path) {
+/*
+ * Keeps the storage health nodes in sysfs open, rather than looking them up and
+ * opening them again for every query, and samples them every
+ * TELEMETRY_SAMPLE_PERIOD_SEC into a history of the last
+ * TELEMETRY_HISTORY_SIZE samples.  The f2fs nodes of /data are looked up
+ * again until /data is mounted.
+ */
+class StorageTelemetry {
+  public:
+    enum Node {
+        kFreeSegments,
+        kDirtySegments,
+        kOvpSegments,
+        kReservedBlocks,
+        kLifetimeWriteKbytes,
+        kLifeTimeA,
+        kLifeTimeB,
+        kLifeTimeC,
+        kNumNodes,
+    };
+
+    static StorageTelemetry& Instance() {
+        // Never destroyed, as the sampling thread is never stopped.
+        static StorageTelemetry* instance = new StorageTelemetry();
+        return *instance;
+    }
+
+    void start() {
+        std::call_once(mStarted, [this] { std::thread(&StorageTelemetry::run, this).detach(); });
+    }
+
+    // The f2fs sysfs directory of /data, or "" if there isn't one (yet).
+    std::string f2fsPath() {
+        std::lock_guard<std::mutex> lock(mLock);
+        resolve();
+        return mF2fsPath;
+    }
+
+    // Reads the current contents of |node|.
+    bool read(Node node, std::string* contents) {
+        int fd;
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            resolve();
+            fd = mFds[node].get();
+            path = mPaths[node];
+        }
+        if (fd < 0) {
+            LOG(WARNING) << "No " << kNodeNames[node] << " to read";
+            return false;
+        }
+        char buf[64];
+        ssize_t n = pread(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            PLOG(WARNING) << "Reading failed in " << path;
+            return false;
+        }
+        contents->assign(buf, n);
+        return true;
+    }
+
+    std::vector<StorageTelemetrySample> history(int64_t sinceMs) {
+        std::lock_guard<std::mutex> lock(mLock);
+        std::vector<StorageTelemetrySample> samples;
+        size_t first = (mHistoryNext + mHistory.size() - mHistoryCount) % mHistory.size();
+        for (size_t i = 0; i < mHistoryCount; i++) {
+            const auto& sample = mHistory[(first + i) % mHistory.size()];
+            if (sample.time_ms > sinceMs) samples.push_back(sample);
+        }
+        return samples;
+    }
+
+    // Returns the value of |node| in |base|, or -1 if it can't be read.  Unlike
+    // read(), doesn't log anything.
+    int64_t readValue(Node node, int base) {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            resolve();
+            fd = mFds[node].get();
+        }
+        char buf[64];
+        ssize_t n = fd < 0 ? -1 : pread(fd, buf, sizeof(buf) - 1, 0);
+        if (n <= 0) return -1;
+        buf[n] = '\0';
+        char* end;
+        errno = 0;
+        unsigned long long value = strtoull(buf, &end, base);
+        if (end == buf || errno != 0 || value > INT64_MAX) return -1;
+        return value;
+    }
+
+  private:
+    static constexpr const char* kNodeNames[kNumNodes] = {
+            "free_segments",         "dirty_segments",           "ovp_segments",
+            "reserved_blocks",       "lifetime_write_kbytes",    "life_time_estimation_a",
+            "life_time_estimation_b", "life_time_estimation_c",
+    };
+
+    void open(Node node, const std::string& path) {
+        mPaths[node] = path;
+        mFds[node].reset(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    }
+
+    // Looks up whichever nodes haven't been found yet.  Called with mLock held.
+    void resolve() {
+        if (mF2fsPath.empty()) {
+            std::list<std::string> paths;
+            addFromFstab(&paths, PathTypes::kBlkDevice, true);
+            if (!paths.empty()) {
+                mF2fsPath = paths.front();
+                for (int node = kFreeSegments; node <= kLifetimeWriteKbytes; node++) {
+                    open(static_cast<Node>(node), mF2fsPath + "/" + kNodeNames[node]);
+                }
+            }
+        }
+        if (!mDevResolved) {
+            mDevResolved = true;
+            std::string path = getDevSysfsPath();
+            if (!path.empty()) {
+                for (int node = kLifeTimeA; node <= kLifeTimeC; node++) {
+                    open(static_cast<Node>(node),
+                         path + "/health_descriptor/" + kNodeNames[node]);
+                }
+            }
+        }
+    }
+
+    void run() {
+        for (;;) {
+            StorageTelemetrySample sample;
+            sample.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     android::base::boot_clock::now().time_since_epoch())
+                                     .count();
+            sample.free_segments = readValue(kFreeSegments, 10);
+            sample.dirty_segments = readValue(kDirtySegments, 10);
+            sample.lifetime_write_kbytes = readValue(kLifetimeWriteKbytes, 0);
+            sample.life_time_a = readValue(kLifeTimeA, 16);
+            sample.life_time_b = readValue(kLifeTimeB, 16);
+            sample.life_time_c = readValue(kLifeTimeC, 16);
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                mHistory[mHistoryNext] = sample;
+                mHistoryNext = (mHistoryNext + 1) % mHistory.size();
+                mHistoryCount = std::min(mHistoryCount + 1, mHistory.size());
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(TELEMETRY_SAMPLE_PERIOD_SEC));
+        }
+    }
+
+    std::once_flag mStarted;
+    std::mutex mLock;
+    std::string mF2fsPath;
+    bool mDevResolved = false;
+    std::array<android::base::unique_fd, kNumNodes> mFds;
+    std::array<std::string, kNumNodes> mPaths;
+    std::array<StorageTelemetrySample, TELEMETRY_HISTORY_SIZE> mHistory;
+    size_t mHistoryNext = 0;
+    size_t mHistoryCount = 0;
+};
+
+void StartStorageTelemetry() {
+    StorageTelemetry::Instance().start();
+}
+
+std::vector<StorageTelemetrySample> GetStorageTelemetry(int64_t sinceMs) {
+    return StorageTelemetry::Instance().history(sinceMs);
+}
+
+static int getLifeTime(StorageTelemetry::Node node) {
     std::string result;
 
-    if (!ReadFileToString(path, &result)) {
-        PLOG(WARNING) << "Reading lifetime estimation failed for " << path;
+    if (!StorageTelemetry::Instance().read(node, &result)) {
         return -1;
     }
     return std::stoi(result, 0, 16);
 }
 
 int32_t GetStorageLifeTime() {
-    std::string path = getDevSysfsPath();
-    if (path.empty()) {
-        return -1;
-    }
-
-    std::string lifeTimeBasePath = path + "/health_descriptor/life_time_estimation_";
-
-    int32_t lifeTime = getLifeTime(lifeTimeBasePath + "c");
+    int32_t lifeTime = getLifeTime(StorageTelemetry::kLifeTimeC);
     if (lifeTime != -1) {
         return lifeTime;
     }
 
-    int32_t lifeTimeA = getLifeTime(lifeTimeBasePath + "a");
-    int32_t lifeTimeB = getLifeTime(lifeTimeBasePath + "b");
+    int32_t lifeTimeA = getLifeTime(StorageTelemetry::kLifeTimeA);
+    int32_t lifeTimeB = getLifeTime(StorageTelemetry::kLifeTimeB);
     lifeTime = std::max(lifeTimeA, lifeTimeB);
     if (lifeTime != -1) {
         return lifeTime == 0 ? -1 : lifeTime * 10;
@@ -508,17 +990,10 @@ int32_t GetStorageLifeTime() {
 }
 
 int32_t GetStorageRemainingLifetime() {
-    std::string path = getDevSysfsPath();
-    if (path.empty()) {
-        return -1;
-    }
-
-    std::string lifeTimeBasePath = path + "/health_descriptor/life_time_estimation_";
-
-    int32_t lifeTime = getLifeTime(lifeTimeBasePath + "c");
+    int32_t lifeTime = getLifeTime(StorageTelemetry::kLifeTimeC);
     if (lifeTime == -1) {
-        int32_t lifeTimeA = getLifeTime(lifeTimeBasePath + "a");
-        int32_t lifeTimeB = getLifeTime(lifeTimeBasePath + "b");
+        int32_t lifeTimeA = getLifeTime(StorageTelemetry::kLifeTimeA);
+        int32_t lifeTimeB = getLifeTime(StorageTelemetry::kLifeTimeB);
         lifeTime = std::max(lifeTimeA, lifeTimeB);
         if (lifeTime <= 0) {
             return -1;
@@ -531,53 +1006,204 @@ int32_t GetStorageRemainingLifetime() {
     return 100 - std::clamp(lifeTime, 0, 100);
 }
 
+static int32_t getLifeTimeWrite() {
+    std::string writeKbytesStr;
+    if (!StorageTelemetry::Instance().read(StorageTelemetry::kLifetimeWriteKbytes,
+                                           &writeKbytesStr)) {
+        return -1;
+    }
+
+    unsigned long long writeBytes = std::strtoull(writeKbytesStr.c_str(), NULL, 0);
+    /* Careful: values > LLONG_MAX can appear in the file due to a kernel bug. */
+    if (writeBytes / KBYTES_IN_SEGMENT > INT32_MAX) {
+        LOG(WARNING) << "Bad lifetime_write_kbytes: " << writeKbytesStr;
+        return -1;
+    }
+    return writeBytes / KBYTES_IN_SEGMENT;
+}
+
+// Reads the free segments, less the reserved ones, and the dirty segments of
+// /data.
+static bool readSegments(int32_t* freeSegments, int32_t* dirtySegments) {
+    auto& telemetry = StorageTelemetry::Instance();
+    std::string freeSegmentsStr, dirtySegmentsStr, ovpSegmentsStr, reservedBlocksStr;
+    if (!telemetry.read(StorageTelemetry::kFreeSegments, &freeSegmentsStr) ||
+        !telemetry.read(StorageTelemetry::kDirtySegments, &dirtySegmentsStr) ||
+        !telemetry.read(StorageTelemetry::kOvpSegments, &ovpSegmentsStr) ||
+        !telemetry.read(StorageTelemetry::kReservedBlocks, &reservedBlocksStr)) {
+        return false;
+    }
+
+    *freeSegments = std::stoi(freeSegmentsStr);
+    *dirtySegments = std::stoi(dirtySegmentsStr);
+    int32_t reservedSegments = std::stoi(ovpSegmentsStr) + std::stoi(reservedBlocksStr) / 512;
+
+    *freeSegments = *freeSegments > reservedSegments ? *freeSegments - reservedSegments : 0;
+    return true;
+}
+
+/*
+ * Keeps adjusting gc_urgent_sleep_time after SetGCUrgentPace() has started
+ * GC, rather than leaving it at what was worked out up front.  Every
+ * GC_PACE_SAMPLE_SEC it compares how fast dirty segments are being reclaimed
+ * with how fast they need to be to reach the target by the end of the GC
+ * period, and scales the sleep time by the ratio, within minGCSleepTime and
+ * one segment per period.  GC goes back to normal as soon as the target is
+ * reached, rather than carrying on at the original pace.  While dirty
+ * segments go up because of the foreground's writes, it doesn't speed up.
+ */
+class GcPaceController {
+  public:
+    static GcPaceController& Instance() {
+        static GcPaceController instance;
+        return instance;
+    }
+
+    void start(const std::string& f2fsSysfsPath, int32_t dirtySegments, int32_t targetSegments,
+               int32_t sleepTime, int32_t minGCSleepTime, int32_t gcPeriod,
+               int32_t targetDirtyRatio) {
+        stop();
+        std::lock_guard<std::mutex> lock(mLock);
+        mPath = f2fsSysfsPath;
+        mInitialDirty = dirtySegments;
+        mLastDirty = dirtySegments;
+        mInitialWrite = getLifeTimeWrite();
+        mLastWrite = mInitialWrite;
+        mMinSleepTime = minGCSleepTime;
+        mMaxSleepTime = std::max(gcPeriod * ONE_MINUTE_IN_MS, minGCSleepTime);
+        mLastSample = std::chrono::steady_clock::now();
+        mDeadline = mLastSample + std::chrono::minutes(gcPeriod);
+
+        mState = {};
+        mState.active = true;
+        mState.sleep_time_ms = sleepTime;
+        mState.target_segments = targetSegments;
+        mState.target_dirty_ratio = targetDirtyRatio;
+        mStopping = false;
+        mThread = std::thread(&GcPaceController::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mStopping = true;
+        }
+        mCv.notify_all();
+        if (mThread.joinable()) mThread.join();
+    }
+
+    GCUrgentPaceState state() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mState;
+    }
+
+  private:
+    ~GcPaceController() { stop(); }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mLock);
+        while (!mCv.wait_for(lock, std::chrono::seconds(GC_PACE_SAMPLE_SEC),
+                             [this] { return mStopping; })) {
+            if (!sample()) break;
+        }
+        mState.active = false;
+    }
+
+    // Adjusts the sleep time from a new sample.  Returns false once GC is done.
+    bool sample() {
+        int32_t freeSegments, dirtySegments;
+        if (!readSegments(&freeSegments, &dirtySegments)) return true;
+        int32_t write = getLifeTimeWrite();
+        auto now = std::chrono::steady_clock::now();
+
+        int32_t totalSegments = freeSegments + dirtySegments;
+        mState.dirty_ratio = totalSegments > 0 ? dirtySegments * 100 / totalSegments : 0;
+        mState.reclaimed_segments = mInitialDirty - dirtySegments;
+        if (write != -1 && mInitialWrite != -1) mState.written_segments = write - mInitialWrite;
+
+        int32_t remaining = mState.target_segments - mState.reclaimed_segments;
+        if (remaining <= 0 || now >= mDeadline) {
+            LOG(INFO) << "GC pace: " << (remaining <= 0 ? "reached target" : "period over")
+                      << ", reclaimed " << mState.reclaimed_segments << " segments, wrote "
+                      << mState.written_segments;
+            if (!WriteStringToFile(std::to_string(GC_NORMAL_MODE), mPath + "/gc_urgent")) {
+                PLOG(WARNING) << "Writing failed in " << mPath << "/gc_urgent";
+            }
+            return false;
+        }
+
+        double minutes = std::chrono::duration<double, std::ratio<60>>(now - mLastSample).count();
+        double reclaimRate = (mLastDirty - dirtySegments) / minutes;
+        double neededRate =
+                remaining / std::chrono::duration<double, std::ratio<60>>(mDeadline - now).count();
+        int32_t written = write != -1 && mLastWrite != -1 ? write - mLastWrite : 0;
+        mState.reclaim_rate = reclaimRate;
+        mState.needed_rate = neededRate;
+        mLastDirty = dirtySegments;
+        mLastWrite = write;
+        mLastSample = now;
+
+        // Change by at most a factor of two at a time, so that one noisy
+        // sample can't throw it off.
+        double scale;
+        if (reclaimRate > 0) {
+            scale = std::clamp(reclaimRate / neededRate, 0.5, 2.0);
+        } else if (written > 0) {
+            // The foreground is writing; speeding up would only get in its way.
+            scale = 1;
+        } else {
+            scale = 0.5;
+        }
+        int32_t sleepTime = std::clamp(static_cast<int32_t>(mState.sleep_time_ms * scale),
+                                       mMinSleepTime, mMaxSleepTime);
+        if (sleepTime != mState.sleep_time_ms) {
+            if (!WriteStringToFile(std::to_string(sleepTime), mPath + "/gc_urgent_sleep_time")) {
+                PLOG(WARNING) << "Writing failed in " << mPath << "/gc_urgent_sleep_time";
+                return true;
+            }
+            LOG(DEBUG) << "GC pace: reclaiming " << reclaimRate << " segments/min, need "
+                       << neededRate << ", sleep time " << sleepTime;
+            mState.sleep_time_ms = sleepTime;
+        }
+        return true;
+    }
+
+    std::mutex mLock;
+    std::condition_variable mCv;
+    std::thread mThread;
+    bool mStopping = false;
+
+    std::string mPath;
+    int32_t mInitialDirty = 0;
+    int32_t mLastDirty = 0;
+    int32_t mInitialWrite = -1;
+    int32_t mLastWrite = -1;
+    int32_t mMinSleepTime = 0;
+    int32_t mMaxSleepTime = 0;
+    std::chrono::steady_clock::time_point mLastSample;
+    std::chrono::steady_clock::time_point mDeadline;
+    GCUrgentPaceState mState;
+};
+
 void SetGCUrgentPace(int32_t neededSegments, int32_t minSegmentThreshold, float dirtyReclaimRate,
                      float reclaimWeight, int32_t gcPeriod, int32_t minGCSleepTime,
                      int32_t targetDirtyRatio) {
-    std::list<std::string> paths;
     bool needGC = false;
     int32_t sleepTime;
 
-    addFromFstab(&paths, PathTypes::kBlkDevice, true);
-    if (paths.empty()) {
+    std::string f2fsSysfsPath = StorageTelemetry::Instance().f2fsPath();
+    if (f2fsSysfsPath.empty()) {
         LOG(WARNING) << "There is no valid blk device path for data partition";
         return;
     }
 
-    std::string f2fsSysfsPath = paths.front();
-    std::string freeSegmentsPath = f2fsSysfsPath + "/free_segments";
-    std::string dirtySegmentsPath = f2fsSysfsPath + "/dirty_segments";
     std::string gcSleepTimePath = f2fsSysfsPath + "/gc_urgent_sleep_time";
     std::string gcUrgentModePath = f2fsSysfsPath + "/gc_urgent";
-    std::string ovpSegmentsPath = f2fsSysfsPath + "/ovp_segments";
-    std::string reservedBlocksPath = f2fsSysfsPath + "/reserved_blocks";
-    std::string freeSegmentsStr, dirtySegmentsStr, ovpSegmentsStr, reservedBlocksStr;
 
-    if (!ReadFileToString(freeSegmentsPath, &freeSegmentsStr)) {
-        PLOG(WARNING) << "Reading failed in " << freeSegmentsPath;
+    int32_t freeSegments, dirtySegments;
+    if (!readSegments(&freeSegments, &dirtySegments)) {
         return;
     }
-
-    if (!ReadFileToString(dirtySegmentsPath, &dirtySegmentsStr)) {
-        PLOG(WARNING) << "Reading failed in " << dirtySegmentsPath;
-        return;
-    }
-
-    if (!ReadFileToString(ovpSegmentsPath, &ovpSegmentsStr)) {
-            PLOG(WARNING) << "Reading failed in " << ovpSegmentsPath;
-            return;
-        }
-
-    if (!ReadFileToString(reservedBlocksPath, &reservedBlocksStr)) {
-            PLOG(WARNING) << "Reading failed in " << reservedBlocksPath;
-            return;
-        }
-
-    int32_t freeSegments = std::stoi(freeSegmentsStr);
-    int32_t dirtySegments = std::stoi(dirtySegmentsStr);
-    int32_t reservedSegments = std::stoi(ovpSegmentsStr) + std::stoi(reservedBlocksStr) / 512;
-
-    freeSegments = freeSegments > reservedSegments ? freeSegments - reservedSegments : 0;
     int32_t totalSegments = freeSegments + dirtySegments;
     int32_t finalTargetSegments = 0;
 
@@ -613,6 +1239,7 @@ void SetGCUrgentPace(int32_t neededSegments, int32_t minSegmentThreshold, float
     }
 
     if (!needGC) {
+        GcPaceController::Instance().stop();
         if (!WriteStringToFile(std::to_string(GC_NORMAL_MODE), gcUrgentModePath)) {
             PLOG(WARNING) << "Writing failed in " << gcUrgentModePath;
         }
@@ -637,30 +1264,142 @@ void SetGCUrgentPace(int32_t neededSegments, int32_t minSegmentThreshold, float
     LOG(INFO) << "Successfully set gc urgent mode: "
               << "free segments: " << freeSegments << ", reclaim target: " << finalTargetSegments
               << ", sleep time: " << sleepTime;
+
+    GcPaceController::Instance().start(f2fsSysfsPath, dirtySegments, finalTargetSegments,
+                                       sleepTime, minGCSleepTime, gcPeriod, targetDirtyRatio);
 }
 
-static int32_t getLifeTimeWrite() {
-    std::list<std::string> paths;
-    addFromFstab(&paths, PathTypes::kBlkDevice, true);
-    if (paths.empty()) {
-        LOG(WARNING) << "There is no valid blk device path for data partition";
+GCUrgentPaceState GetGCUrgentPaceState() {
+    return GcPaceController::Instance().state();
+}
+
+namespace {
+
+// Cumulative write counters of /data at one point in time.
+struct WriteCounters {
+    std::chrono::steady_clock::time_point time;
+    int64_t app_kbytes = -1;
+    int64_t fs_kbytes = -1;
+};
+
+// Write accounting baselines, by consumer.
+std::mutex writeAccountingLock;
+std::map<std::string, WriteCounters> writeAccountingBaselines;
+// Whether iostat_enable was set for the write accounting consumers.
+bool iostatEnabledForAccounting = false;
+
+}  // namespace
+
+// Sums the app writes in the [WRITE] section of f2fs's iostat_info, which is
+// only kept while iostat_enable is set (see startAppWriteCounting()).  Returns
+// -1 if there are none.
+static int64_t readAppWriteKbytes(const std::string& f2fsSysfsPath) {
+    std::string contents;
+    if (!ReadFileToString("/proc/fs/f2fs/" + Basename(f2fsSysfsPath) + "/iostat_info",
+                          &contents)) {
         return -1;
     }
+    bool inWrite = false;
+    bool found = false;
+    uint64_t bytes = 0;
+    for (const auto& line : android::base::Split(contents, "\n")) {
+        if (android::base::StartsWith(line, "[")) {
+            inWrite = line == "[WRITE]";
+            continue;
+        }
+        auto colon = line.find(':');
+        if (!inWrite || !android::base::StartsWith(line, "app ") || colon == std::string::npos) {
+            continue;
+        }
+        uint64_t value;
+        if (android::base::ParseUint(android::base::Trim(line.substr(colon + 1)), &value)) {
+            bytes += value;
+            found = true;
+        }
+    }
+    return found ? bytes / 1024 : -1;
+}
 
-    std::string writeKbytesPath = paths.front() + "/lifetime_write_kbytes";
-    std::string writeKbytesStr;
-    if (!ReadFileToString(writeKbytesPath, &writeKbytesStr)) {
-        PLOG(WARNING) << "Reading failed in " << writeKbytesPath;
-        return -1;
+// f2fs only counts app writes while iostat_enable is set, and nothing sets it
+// by default.  It's set while there are write accounting consumers, and cleared
+// again afterwards unless it was already set.
+static void startAppWriteCounting() {
+    std::string f2fsSysfsPath = StorageTelemetry::Instance().f2fsPath();
+    if (f2fsSysfsPath.empty()) return;
+    std::string path = f2fsSysfsPath + "/iostat_enable";
+    std::string value;
+    if (ReadFileToString(path, &value) && android::base::Trim(value) == "1") return;
+    if (!WriteStringToFile("1", path)) {
+        PLOG(WARNING) << "Writing failed in " << path;
+        return;
     }
+    iostatEnabledForAccounting = true;
+}
 
-    unsigned long long writeBytes = std::strtoull(writeKbytesStr.c_str(), NULL, 0);
-    /* Careful: values > LLONG_MAX can appear in the file due to a kernel bug. */
-    if (writeBytes / KBYTES_IN_SEGMENT > INT32_MAX) {
-        LOG(WARNING) << "Bad lifetime_write_kbytes: " << writeKbytesStr;
-        return -1;
+static void stopAppWriteCounting() {
+    if (!iostatEnabledForAccounting) return;
+    iostatEnabledForAccounting = false;
+    std::string f2fsSysfsPath = StorageTelemetry::Instance().f2fsPath();
+    if (f2fsSysfsPath.empty()) return;
+    std::string path = f2fsSysfsPath + "/iostat_enable";
+    if (!WriteStringToFile("0", path)) {
+        PLOG(WARNING) << "Writing failed in " << path;
+    }
+}
+
+static WriteCounters readWriteCounters() {
+    WriteCounters counters;
+    counters.time = std::chrono::steady_clock::now();
+    std::string f2fsSysfsPath = StorageTelemetry::Instance().f2fsPath();
+    if (f2fsSysfsPath.empty()) return counters;
+
+    counters.app_kbytes = readAppWriteKbytes(f2fsSysfsPath);
+    counters.fs_kbytes =
+            StorageTelemetry::Instance().readValue(StorageTelemetry::kLifetimeWriteKbytes, 0);
+    return counters;
+}
+
+bool GetWriteAccounting(const std::string& consumer, bool reset, WriteAccounting* accounting) {
+    std::lock_guard<std::mutex> lock(writeAccountingLock);
+    auto it = writeAccountingBaselines.find(consumer);
+    if (it == writeAccountingBaselines.end()) {
+        if (writeAccountingBaselines.size() >= WRITE_ACCOUNTING_MAX_CONSUMERS) {
+            LOG(WARNING) << "Too many write accounting consumers for " << consumer;
+            return false;
+        }
+        if (writeAccountingBaselines.empty()) startAppWriteCounting();
+        it = writeAccountingBaselines.emplace(consumer, readWriteCounters()).first;
+    }
+    WriteCounters now = readWriteCounters();
+    const WriteCounters& baseline = it->second;
+
+    *accounting = {};
+    accounting->window_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    now.time - baseline.time)
+                                    .count();
+    if (now.app_kbytes >= 0 && baseline.app_kbytes >= 0) {
+        accounting->app_write_kbytes = now.app_kbytes - baseline.app_kbytes;
+    }
+    if (now.fs_kbytes >= 0 && baseline.fs_kbytes >= 0) {
+        accounting->fs_write_kbytes = now.fs_kbytes - baseline.fs_kbytes;
+    }
+    if (accounting->app_write_kbytes > 0 && accounting->fs_write_kbytes >= 0) {
+        accounting->write_amplification =
+                static_cast<float>(accounting->fs_write_kbytes) / accounting->app_write_kbytes;
+    }
+    StorageTelemetry& telemetry = StorageTelemetry::Instance();
+    accounting->life_time_a = telemetry.readValue(StorageTelemetry::kLifeTimeA, 16);
+    accounting->life_time_b = telemetry.readValue(StorageTelemetry::kLifeTimeB, 16);
+
+    if (reset) it->second = now;
+    return true;
+}
+
+void RemoveWriteAccounting(const std::string& consumer) {
+    std::lock_guard<std::mutex> lock(writeAccountingLock);
+    if (writeAccountingBaselines.erase(consumer) != 0 && writeAccountingBaselines.empty()) {
+        stopAppWriteCounting();
     }
-    return writeBytes / KBYTES_IN_SEGMENT;
 }
 
 void RefreshLatestWrite() {
@@ -19,20 +19,81 @@
 
 #include "android/os/IVoldTaskListener.h"
 
+#include <string>
+#include <vector>
+
 namespace android {
 namespace vold {
 
-void Trim(const android::sp<android::os::IVoldTaskListener>& listener);
+// If |incremental|, each filesystem is trimmed a chunk at a time, stopping at
+// the time limit or an abort, and carrying on from there the next time.
+void Trim(const android::sp<android::os::IVoldTaskListener>& listener, bool incremental = false);
 int RunIdleMaint(bool needGC, const android::sp<android::os::IVoldTaskListener>& listener);
 int AbortIdleMaint(const android::sp<android::os::IVoldTaskListener>& listener);
 int32_t GetStorageLifeTime();
 int32_t GetStorageRemainingLifetime();
+
+// A sample of the storage health nodes in sysfs.  Values that aren't
+// available are -1.
+struct StorageTelemetrySample {
+    // Since boot, like elapsedRealtime().
+    int64_t time_ms = 0;
+    // Of /data, including the reserved ones.
+    int32_t free_segments = -1;
+    int32_t dirty_segments = -1;
+    int64_t lifetime_write_kbytes = -1;
+    // The eMMC/UFS life time estimates, in steps of 10% used.
+    int32_t life_time_a = -1;
+    int32_t life_time_b = -1;
+    int32_t life_time_c = -1;
+};
+void StartStorageTelemetry();
+// Returns the samples taken after |sinceMs|, oldest first.
+std::vector<StorageTelemetrySample> GetStorageTelemetry(int64_t sinceMs);
 void SetGCUrgentPace(int32_t neededSegments, int32_t minSegmentThreshold, float dirtyReclaimRate,
                      float reclaimWeight, int32_t gcPeriod, int32_t minGCSleepTime,
                      int32_t targetDirtyRatio);
+
+// What the controller that SetGCUrgentPace() starts is doing.  Rates are in
+// segments per minute.
+struct GCUrgentPaceState {
+    bool active = false;
+    int32_t sleep_time_ms = 0;
+    int32_t target_segments = 0;
+    int32_t reclaimed_segments = 0;
+    // Written while GC was running, by it and by the foreground.
+    int32_t written_segments = 0;
+    float reclaim_rate = 0;
+    float needed_rate = 0;
+    int32_t dirty_ratio = 0;
+    int32_t target_dirty_ratio = 0;
+};
+GCUrgentPaceState GetGCUrgentPaceState();
+
 void RefreshLatestWrite();
 int32_t GetWriteAmount();
 
+// Writes to /data over a window, from sources that are -1 if unavailable.
+struct WriteAccounting {
+    int64_t window_ms = 0;
+    // Written by apps, as counted by f2fs's iostat, which is enabled while there
+    // are consumers.  Unavailable if the kernel lacks CONFIG_F2FS_IOSTAT.
+    int64_t app_write_kbytes = -1;
+    // Written by f2fs to the device, including GC, node and metadata writes
+    // (lifetime_write_kbytes).
+    int64_t fs_write_kbytes = -1;
+    // fs_write_kbytes / app_write_kbytes.
+    float write_amplification = -1;
+    // The device's current wear estimates, in steps of 10% used.
+    int32_t life_time_a = -1;
+    int32_t life_time_b = -1;
+};
+// Each |consumer| has a baseline of its own, set on its first call and, if
+// |reset|, moved to the end of the window that is returned.  Returns false if
+// there are too many consumers to add another.
+bool GetWriteAccounting(const std::string& consumer, bool reset, WriteAccounting* accounting);
+void RemoveWriteAccounting(const std::string& consumer);
+
 }  // namespace vold
 }  // namespace android
 
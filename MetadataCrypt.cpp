@@ -66,6 +66,10 @@ struct CryptoOptions {
 
 static const std::string kDmNameUserdata = "userdata";
 
+// Where the progress of in-place encryption is saved, so that it can resume
+// after an interruption.  One file per block device, named after it.
+static const std::string kInPlaceProgressDir = "/metadata/vold/encrypt_inplace";
+
 // The first entry in this table is the default crypto type.
 constexpr CryptoType supported_crypto_types[] = {aes_256_xts, adiantum};
 
@@ -245,10 +249,29 @@ static bool parse_options(const std::string& options_string, CryptoOptions* opti
     return true;
 }
 
+// Passes the progress of an in-place encryption on to |listener|.  The status
+// is the percentage done, and the details are in the extras.
+static void report_encrypt_progress(const android::sp<android::os::IVoldTaskListener>& listener,
+                                    const EncryptInPlaceProgress& progress) {
+    if (!listener) return;
+    int percent = 0;
+    if (progress.blocks_total > 0)
+        percent = std::min<uint64_t>(100, progress.blocks_done * 100 / progress.blocks_total);
+
+    android::os::PersistableBundle extras;
+    extras.putLong(String16("blocks_done"), progress.blocks_done);
+    extras.putLong(String16("blocks_total"), progress.blocks_total);
+    extras.putInt(String16("block_size"), progress.block_size);
+    extras.putLong(String16("bytes_per_sec"), progress.bytes_per_sec);
+    extras.putLong(String16("eta_sec"), progress.eta.count());
+    listener->onStatus(percent, extras);
+}
+
 bool fscrypt_mount_metadata_encrypted(const std::string& blk_device, const std::string& mount_point,
                                       bool needs_encrypt, bool should_format,
                                       const std::string& fs_type, bool is_zoned,
-                                      const std::vector<std::string>& user_devices) {
+                                      const std::vector<std::string>& user_devices,
+                                      const android::sp<android::os::IVoldTaskListener>& listener) {
     LOG(DEBUG) << "fscrypt_mount_metadata_encrypted: " << mount_point
                << " encrypt: " << needs_encrypt << " format: " << should_format << " with "
                << fs_type << " block device: " << blk_device << " with zoned " << is_zoned;
@@ -334,8 +357,17 @@ bool fscrypt_mount_metadata_encrypted(const std::string& blk_device, const std::
         crypto_user_blkdev.push_back(crypto_blkdev_arg.c_str());
     }
 
+    // If a previous in-place encryption got interrupted, the key already exists
+    // so fs_mgr doesn't ask for encryption, but it still has to be finished.
+    auto progress_path = kInPlaceProgressDir + "/" + Basename(blk_device);
+    bool resume_encrypt = !needs_encrypt && encrypt_inplace_interrupted(progress_path);
+    if (resume_encrypt) {
+        LOG(INFO) << "In-place encryption of " << blk_device << " was interrupted; resuming it";
+        needs_encrypt = true;
+    }
+
     if (needs_encrypt) {
-        if (should_format) {
+        if (should_format && !resume_encrypt) {
             status_t error;
 
             if (fs_type == "ext4") {
@@ -358,7 +390,11 @@ bool fscrypt_mount_metadata_encrypted(const std::string& blk_device, const std::
                               "format it.";
                 return false;
             }
-            if (!encrypt_inplace(crypto_blkdev, blk_device, nr_sec)) {
+            bool success = encrypt_inplace(crypto_blkdev, blk_device, nr_sec, progress_path,
+                                           nullptr, [&](const EncryptInPlaceProgress& progress) {
+                                               report_encrypt_progress(listener, progress);
+                                           });
+            if (!success) {
                 LOG(ERROR) << "encrypt_inplace failed in mountFstab";
                 return false;
             }
@@ -21,6 +21,7 @@
 
 #include "KeyBuffer.h"
 #include "KeyUtil.h"
+#include "android/os/IVoldTaskListener.h"
 
 namespace android {
 namespace vold {
@@ -29,7 +30,9 @@ void defaultkey_precreate_dm_device();
 bool fscrypt_mount_metadata_encrypted(const std::string& block_device,
                                       const std::string& mount_point, bool needs_encrypt,
                                       bool should_format, const std::string& fs_type, bool is_zoned,
-                                      const std::vector<std::string>& user_devices);
+                                      const std::vector<std::string>& user_devices,
+                                      const android::sp<android::os::IVoldTaskListener>& listener =
+                                              nullptr);
 
 bool defaultkey_volume_keygen(KeyGeneration* gen);
 
@@ -19,160 +19,381 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fts.h>
+#include <limits.h>
 #include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/pidfd.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <mntent.h>
-#include <unordered_set>
+#include <thread>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 
 #include "Process.h"
 #include "Utils.h"
 
 using android::base::StringPrintf;
+using android::base::unique_fd;
 
 namespace android {
 namespace vold {
 
-static bool checkMaps(const std::string& path, const std::string& prefix) {
-    bool found = false;
-    auto file = std::unique_ptr<FILE, decltype(&fclose)>{fopen(path.c_str(), "re"), fclose};
-    if (!file) {
-        return false;
-    }
+using namespace std::chrono_literals;
+
+// The /proc walk is split between up to this many threads, each taking at
+// least kMinPidsPerScanThread processes.
+static constexpr size_t kMaxScanThreads = 4;
+static constexpr size_t kMinPidsPerScanThread = 64;
+
+// Appends the target of the symlink |name| in |dirfd| to |files| if it's a path.
+static void readSymlinkAt(int dirfd, const char* name, std::vector<std::string>* files) {
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(dirfd, name, target, sizeof(target));
+    if (len > 0 && target[0] == '/') files->emplace_back(target, len);
+}
+
+// Appends the mapped paths in the maps of |pid_dirfd| to |files|.  The maps
+// are parsed in place, rather than copying out every line.
+static void readMapsAt(int pid_dirfd, std::vector<std::string>* files) {
+    unique_fd fd(openat(pid_dirfd, "maps", O_RDONLY | O_CLOEXEC));
+    if (fd < 0) return;
 
-    char* buf = nullptr;
+    // A line is the path plus a few short fields, so should always fit.  One
+    // that doesn't is taken up to the end of the buffer and the rest of it is
+    // skipped.
+    char buf[2 * PATH_MAX];
     size_t len = 0;
-    while (getline(&buf, &len, file.get()) != -1) {
-        std::string line(buf);
-        std::string::size_type pos = line.find('/');
-        if (pos != std::string::npos) {
-            line = line.substr(pos);
-            if (android::base::StartsWith(line, prefix)) {
-                LOG(WARNING) << "Found map " << path << " referencing " << line;
-                found = true;
-                break;
+    bool skipping = false;
+    for (;;) {
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, buf + len, sizeof(buf) - len));
+        if (n <= 0) return;
+        len += n;
+
+        size_t start = 0;
+        for (;;) {
+            char* nl = static_cast<char*>(memchr(buf + start, '\n', len - start));
+            size_t end = nl ? nl - buf : len;
+            if (!nl && (start > 0 || len < sizeof(buf))) break;
+
+            char* slash = static_cast<char*>(memchr(buf + start, '/', end - start));
+            // Consecutive mappings are usually of the same file.
+            if (!skipping && slash &&
+                (files->empty() || files->back().compare(0, std::string::npos, slash,
+                                                         buf + end - slash) != 0)) {
+                files->emplace_back(slash, buf + end - slash);
             }
+            skipping = !nl;
+            start = nl ? end + 1 : len;
         }
+        memmove(buf, buf + start, len - start);
+        len -= start;
     }
-    free(buf);
+}
 
-    return found;
+// Collects |pid| from |proc_dirfd| into |process| and, unless |files| is null,
+// the paths it has open or mapped, or as its cwd, root or executable.
+// Returns false if it has exited.
+static bool collectProcess(int proc_dirfd, pid_t pid, ProcessSnapshot::Process* process,
+                           std::vector<std::string>* files) {
+    char name[16];
+    snprintf(name, sizeof(name), "%d", pid);
+    unique_fd pid_fd(openat(proc_dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    struct stat sb;
+    if (pid_fd < 0 || fstat(pid_fd, &sb) != 0) return false;
+
+    process->pid = pid;
+    process->uid = sb.st_uid;
+    if (fstatat(pid_fd, "ns/mnt", &sb, 0) == 0) process->mnt_ns = sb.st_ino;
+    char exe[PATH_MAX];
+    ssize_t len = readlinkat(pid_fd, "exe", exe, sizeof(exe));
+    if (len > 0) process->exe.assign(exe, len);
+    if (!files) return true;
+
+    if (!process->exe.empty()) files->push_back(process->exe);
+    readSymlinkAt(pid_fd, "cwd", files);
+    readSymlinkAt(pid_fd, "root", files);
+
+    int fd_dirfd = openat(pid_fd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    auto fd_d = std::unique_ptr<DIR, int (*)(DIR*)>(
+            fd_dirfd < 0 ? nullptr : fdopendir(fd_dirfd), closedir);
+    if (!fd_d) {
+        if (fd_dirfd >= 0) close(fd_dirfd);
+        PLOG(WARNING) << "Failed to open /proc/" << pid << "/fd";
+    } else {
+        struct dirent* fd_de;
+        while ((fd_de = readdir(fd_d.get())) != nullptr) {
+            if (fd_de->d_type != DT_LNK) continue;
+            readSymlinkAt(fd_dirfd, fd_de->d_name, files);
+        }
+    }
+
+    readMapsAt(pid_fd, files);
+    std::sort(files->begin(), files->end());
+    files->erase(std::unique(files->begin(), files->end()), files->end());
+    return true;
 }
 
-static bool checkSymlink(const std::string& path, const std::string& prefix) {
-    std::string res;
-    if (android::base::Readlink(path, &res)) {
-        if (android::base::StartsWith(res, prefix)) {
-            LOG(WARNING) << "Found symlink " << path << " referencing " << res;
-            return true;
+// Appends the tmpfs mount points in the mount namespace of |pid| to |mounts|.
+static bool readTmpfsMounts(pid_t pid, std::vector<std::string>* mounts) {
+    std::string mounts_file(StringPrintf("/proc/%d/mounts", pid));
+    auto fp = std::unique_ptr<FILE, int (*)(FILE*)>(setmntent(mounts_file.c_str(), "r"),
+                                                    endmntent);
+    if (!fp) {
+        PLOG(WARNING) << "Failed to open " << mounts_file;
+        return false;
+    }
+
+    mntent* mentry;
+    while ((mentry = getmntent(fp.get())) != nullptr) {
+        if (mentry->mnt_fsname != nullptr && strncmp(mentry->mnt_fsname, "tmpfs", 5) == 0) {
+            mounts->push_back(mentry->mnt_dir);
         }
     }
-    return false;
+    return true;
 }
 
-// TODO: Refactor the code with KillProcessesWithOpenFiles().
-int KillProcessesWithTmpfsMounts(const std::string& prefix, int signal) {
-    std::unordered_set<pid_t> pids;
+bool ProcessSnapshot::scan(bool withFiles) {
+    mWithFiles = withFiles;
+    mProcesses.clear();
+    mFiles.clear();
+    mTmpfsMounts.clear();
 
     auto proc_d = std::unique_ptr<DIR, int (*)(DIR*)>(opendir("/proc"), closedir);
     if (!proc_d) {
         PLOG(ERROR) << "Failed to open proc";
-        return -1;
+        return false;
     }
 
+    std::vector<pid_t> pids;
     struct dirent* proc_de;
     while ((proc_de = readdir(proc_d.get())) != nullptr) {
         // We only care about valid PIDs
         pid_t pid;
         if (proc_de->d_type != DT_DIR) continue;
         if (!android::base::ParseInt(proc_de->d_name, &pid)) continue;
+        pids.push_back(pid);
+    }
+    collect(dirfd(proc_d.get()), pids);
+    return true;
+}
+
+void ProcessSnapshot::refresh(const std::string& prefix) {
+    std::vector<pid_t> pids = findTmpfsMounts(prefix);
+    for (const auto& [pid, path] : findOpenFiles(prefix)) pids.push_back(pid);
+    std::sort(pids.begin(), pids.end());
+    pids.erase(std::unique(pids.begin(), pids.end()), pids.end());
+    if (pids.empty()) return;
+
+    auto refreshed = [&pids](pid_t pid) {
+        return std::binary_search(pids.begin(), pids.end(), pid);
+    };
+    for (auto it = mFiles.begin(); it != mFiles.end();) {
+        auto& entry = it->second;
+        entry.erase(std::remove_if(entry.begin(), entry.end(), refreshed), entry.end());
+        it = entry.empty() ? mFiles.erase(it) : std::next(it);
+    }
+    for (const auto& process : mProcesses) {
+        if (refreshed(process.pid)) mTmpfsMounts.erase(process.mnt_ns);
+    }
+    mProcesses.erase(std::remove_if(mProcesses.begin(), mProcesses.end(),
+                                    [&](const Process& process) {
+                                        return refreshed(process.pid);
+                                    }),
+                     mProcesses.end());
+
+    unique_fd proc_fd(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (proc_fd < 0) {
+        PLOG(ERROR) << "Failed to open proc";
+        return;
+    }
+    collect(proc_fd, pids);
+}
 
-        // Look for references to prefix
-        std::string mounts_file(StringPrintf("/proc/%d/mounts", pid));
-        auto fp = std::unique_ptr<FILE, int (*)(FILE*)>(
-                setmntent(mounts_file.c_str(), "r"), endmntent);
-        if (!fp) {
-            PLOG(WARNING) << "Failed to open " << mounts_file;
-            continue;
+// Adds |pids| to the snapshot.  The processes are shared out between a few
+// threads, which take the next one as they go.
+void ProcessSnapshot::collect(int proc_dirfd, const std::vector<pid_t>& pids) {
+    std::vector<Process> processes(pids.size());
+    std::vector<std::vector<std::string>> files(mWithFiles ? pids.size() : 0);
+    std::vector<char> alive(pids.size());
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < pids.size();) {
+            alive[i] = collectProcess(proc_dirfd, pids[i], &processes[i],
+                                      mWithFiles ? &files[i] : nullptr);
         }
+    };
 
-        // Check if obb directory is mounted, and get all packages of mounted app data directory.
-        mntent* mentry;
-        while ((mentry = getmntent(fp.get())) != nullptr) {
-            if (mentry->mnt_fsname != nullptr && strncmp(mentry->mnt_fsname, "tmpfs", 5) == 0
-                    && android::base::StartsWith(mentry->mnt_dir, prefix)) {
-                pids.insert(pid);
-                break;
-            }
+    size_t num_threads = std::min({kMaxScanThreads,
+                                   static_cast<size_t>(std::thread::hardware_concurrency()),
+                                   pids.size() / kMinPidsPerScanThread});
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; i++) threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+
+    for (size_t i = 0; i < pids.size(); i++) {
+        if (!alive[i]) continue;
+        if (mWithFiles) {
+            for (auto& path : files[i]) mFiles[std::move(path)].push_back(pids[i]);
         }
+        mProcesses.push_back(std::move(processes[i]));
     }
-    if (signal != 0) {
-        for (const auto& pid : pids) {
-            LOG(WARNING) << "Killing pid "<< pid << " with signal " << strsignal(signal) <<
-                    " because it has a mount with prefix " << prefix;
-            kill(pid, signal);
+    std::sort(mProcesses.begin(), mProcesses.end(),
+              [](const Process& a, const Process& b) { return a.pid < b.pid; });
+}
+
+std::map<pid_t, std::string> ProcessSnapshot::findOpenFiles(const std::string& prefix) const {
+    std::map<pid_t, std::string> found;
+    for (auto it = mFiles.lower_bound(prefix);
+         it != mFiles.end() && android::base::StartsWith(it->first, prefix); ++it) {
+        for (pid_t pid : it->second) found.emplace(pid, it->first);
+    }
+    return found;
+}
+
+std::vector<pid_t> ProcessSnapshot::findTmpfsMounts(const std::string& prefix) {
+    std::vector<pid_t> pids;
+    for (const auto& process : mProcesses) {
+        // Processes in the same mount namespace share their mounts, so they're
+        // only read once, unless the namespace isn't known.
+        std::vector<std::string> uncached;
+        const std::vector<std::string>* mounts = &uncached;
+        if (process.mnt_ns == 0) {
+            if (!readTmpfsMounts(process.pid, &uncached)) continue;
+        } else {
+            auto it = mTmpfsMounts.find(process.mnt_ns);
+            if (it == mTmpfsMounts.end()) {
+                if (!readTmpfsMounts(process.pid, &uncached)) continue;
+                it = mTmpfsMounts.emplace(process.mnt_ns, std::move(uncached)).first;
+            }
+            mounts = &it->second;
+        }
+
+        if (std::any_of(mounts->begin(), mounts->end(), [&](const std::string& mount) {
+                return android::base::StartsWith(mount, prefix);
+            })) {
+            pids.push_back(process.pid);
         }
     }
-    return pids.size();
+    return pids;
 }
 
-int KillProcessesWithOpenFiles(const std::string& prefix, int signal, bool killFuseDaemon) {
-    std::unordered_set<pid_t> pids;
+bool ProcessSnapshot::sendSignal(pid_t pid, int signal) {
+    auto it = mSignalled.find(pid);
+    if (it != mSignalled.end() && it->second >= 0) {
+        if (pidfd_send_signal(it->second, signal, nullptr, 0) == 0) {
+            mWaiting.insert(pid);
+            return true;
+        }
+        if (errno != ESRCH) return false;
+        // It has exited, but the pid was found again, so it's been reused.
+        mSignalled.erase(it);
+    }
 
-    auto proc_d = std::unique_ptr<DIR, int (*)(DIR*)>(opendir("/proc"), closedir);
-    if (!proc_d) {
-        PLOG(ERROR) << "Failed to open proc";
-        return -1;
+    unique_fd pidfd(pidfd_open(pid, 0));
+    if (pidfd < 0) {
+        if (errno != ENOSYS) return false;
+        if (kill(pid, signal) != 0) return false;
+    } else if (pidfd_send_signal(pidfd, signal, nullptr, 0) != 0) {
+        return false;
     }
+    mSignalled[pid] = std::move(pidfd);
+    mWaiting.insert(pid);
+    return true;
+}
 
-    struct dirent* proc_de;
-    while ((proc_de = readdir(proc_d.get())) != nullptr) {
-        // We only care about valid PIDs
-        pid_t pid;
-        if (proc_de->d_type != DT_DIR) continue;
-        if (!android::base::ParseInt(proc_de->d_name, &pid)) continue;
+bool ProcessSnapshot::waitForExit(std::chrono::milliseconds timeout) {
+    // Processes signalled in earlier passes aren't waited on again, as one
+    // that handled its signal and stopped using the path may keep running.
+    std::set<pid_t> waiting;
+    waiting.swap(mWaiting);
 
-        // Look for references to prefix
-        bool found = false;
-        auto path = StringPrintf("/proc/%d", pid);
-        found |= checkMaps(path + "/maps", prefix);
-        found |= checkSymlink(path + "/cwd", prefix);
-        found |= checkSymlink(path + "/root", prefix);
-        found |= checkSymlink(path + "/exe", prefix);
-
-        auto fd_path = path + "/fd";
-        auto fd_d = std::unique_ptr<DIR, int (*)(DIR*)>(opendir(fd_path.c_str()), closedir);
-        if (!fd_d) {
-            PLOG(WARNING) << "Failed to open " << fd_path;
-        } else {
-            struct dirent* fd_de;
-            while ((fd_de = readdir(fd_d.get())) != nullptr) {
-                if (fd_de->d_type != DT_LNK) continue;
-                found |= checkSymlink(fd_path + "/" + fd_de->d_name, prefix);
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+        // Without pidfds, whether the processes have exited is checked
+        // every so often instead.
+        std::vector<pollfd> fds;
+        std::vector<pid_t> pids;
+        bool untracked = false;
+        for (auto it = waiting.begin(); it != waiting.end();) {
+            auto signalled = mSignalled.find(*it);
+            if (signalled == mSignalled.end()) {
+                it = waiting.erase(it);
+                continue;
+            }
+            if (signalled->second < 0 && kill(*it, 0) != 0 && errno == ESRCH) {
+                mSignalled.erase(signalled);
+                it = waiting.erase(it);
+                continue;
             }
+            if (signalled->second >= 0) {
+                fds.push_back({signalled->second.get(), POLLIN, 0});
+                pids.push_back(*it);
+            } else {
+                untracked = true;
+            }
+            ++it;
         }
+        if (waiting.empty()) return true;
 
-        if (found) {
-            if (!IsFuseDaemon(pid) || killFuseDaemon) {
-                pids.insert(pid);
-            } else {
-                LOG(WARNING) << "Found FUSE daemon with open file. Skipping...";
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+        if (remaining < 0ms) return false;
+        if (untracked) remaining = std::min(remaining, 100ms);
+        int ret = TEMP_FAILURE_RETRY(poll(fds.data(), fds.size(), remaining.count()));
+        if (ret < 0) {
+            PLOG(ERROR) << "Failed to wait for processes to exit";
+            return false;
+        }
+        // A pidfd is readable once its process has exited.
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i].revents != 0) {
+                mSignalled.erase(pids[i]);
+                waiting.erase(pids[i]);
             }
         }
     }
+}
+
+int KillProcessesWithTmpfsMounts(ProcessSnapshot& snapshot, const std::string& prefix,
+                                 int signal) {
+    std::vector<pid_t> pids = snapshot.findTmpfsMounts(prefix);
+    if (signal != 0) {
+        for (const auto& pid : pids) {
+            LOG(WARNING) << "Killing pid "<< pid << " with signal " << strsignal(signal) <<
+                    " because it has a mount with prefix " << prefix;
+            snapshot.sendSignal(pid, signal);
+        }
+    }
+    return pids.size();
+}
+
+int KillProcessesWithOpenFiles(ProcessSnapshot& snapshot, const std::string& prefix, int signal,
+                               bool killFuseDaemon) {
+    std::vector<pid_t> pids;
+    for (const auto& [pid, path] : snapshot.findOpenFiles(prefix)) {
+        LOG(WARNING) << "Found pid " << pid << " referencing " << path;
+        if (!IsFuseDaemon(pid) || killFuseDaemon) {
+            pids.push_back(pid);
+        } else {
+            LOG(WARNING) << "Found FUSE daemon with open file. Skipping...";
+        }
+    }
     int totalKilledPids = pids.size();
     if (signal != 0) {
         for (const auto& pid : pids) {
@@ -185,7 +406,7 @@ int KillProcessesWithOpenFiles(const std::string& prefix, int signal, bool killF
 
             LOG(WARNING) << "Sending " << strsignal(signal) << " to pid " << pid << " (" << comm
                          << ", " << exe << ")";
-            if (kill(pid, signal) < 0) {
+            if (!snapshot.sendSignal(pid, signal)) {
                 if (errno == ESRCH) {
                     totalKilledPids--;
                     LOG(WARNING) << "The target pid " << pid << " was already killed";
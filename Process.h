@@ -17,11 +17,81 @@
 #ifndef _PROCESS_H
 #define _PROCESS_H
 
+#include <sys/types.h>
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
 namespace android {
 namespace vold {
 
-int KillProcessesWithOpenFiles(const std::string& path, int signal, bool killFuseDaemon = true);
-int KillProcessesWithTmpfsMounts(const std::string& path, int signal);
+/*
+ * A snapshot of the processes in /proc, taken in a single walk, for the
+ * passes that look for processes using a path to query instead of walking
+ * /proc again each time.  The paths that processes reference are indexed by
+ * path, so those under a prefix are found by a lookup rather than by checking
+ * every process.  Not thread-safe.
+ */
+class ProcessSnapshot {
+  public:
+    struct Process {
+        pid_t pid = 0;
+        uid_t uid = 0;
+        // Inode of the process's mount namespace, or 0 if unknown.
+        ino_t mnt_ns = 0;
+        std::string exe;
+    };
+
+    // Walks /proc, replacing any earlier snapshot.  Unless |withFiles|, only
+    // the Process fields are collected, and findOpenFiles() finds nothing.
+    // Returns false if /proc can't be read.
+    bool scan(bool withFiles = true);
+    // Collects the processes that findOpenFiles() or findTmpfsMounts() would
+    // return for |prefix| again, dropping those that have exited since.
+    void refresh(const std::string& prefix);
+
+    // Sorted by pid.
+    const std::vector<Process>& processes() const { return mProcesses; }
+    // Returns the processes that have a file under |prefix| open or mapped,
+    // or as their cwd, root or executable, with the first such path of each.
+    std::map<pid_t, std::string> findOpenFiles(const std::string& prefix) const;
+    // Returns the processes that have tmpfs mounted under |prefix|.
+    std::vector<pid_t> findTmpfsMounts(const std::string& prefix);
+
+    // Sends |signal| to |pid| through a pidfd, which is kept so that it can be
+    // waited on, and so that later signals go to the same process even if its
+    // pid has been reused.  Returns false with errno set on failure, which is
+    // ESRCH if it has exited.
+    bool sendSignal(pid_t pid, int signal);
+    // Waits until every process that has been sent a signal since the last
+    // wait has exited, or |timeout| has passed.  Returns whether they have all
+    // exited.
+    bool waitForExit(std::chrono::milliseconds timeout);
+
+  private:
+    void collect(int proc_dirfd, const std::vector<pid_t>& pids);
+
+    bool mWithFiles = true;
+    std::vector<Process> mProcesses;
+    // The pids referencing each path.
+    std::map<std::string, std::vector<pid_t>> mFiles;
+    // The tmpfs mount points in each mount namespace, read as they're needed.
+    std::map<ino_t, std::vector<std::string>> mTmpfsMounts;
+    // The processes that have been sent a signal and might not have exited
+    // yet.  The pidfd is -1 if the kernel doesn't support pidfds.
+    std::map<pid_t, android::base::unique_fd> mSignalled;
+    // The processes sent a signal since the last waitForExit().
+    std::set<pid_t> mWaiting;
+};
+
+int KillProcessesWithOpenFiles(ProcessSnapshot& snapshot, const std::string& path, int signal,
+                               bool killFuseDaemon = true);
+int KillProcessesWithTmpfsMounts(ProcessSnapshot& snapshot, const std::string& path, int signal);
 
 }  // namespace vold
 }  // namespace android
@@ -483,20 +483,26 @@ status_t ForceUnmount(const std::string& path) {
     // we start sending signals
     if (sSleepOnUnmount) sleep(5);
 
-    KillProcessesWithOpenFiles(path, SIGINT);
-    if (sSleepOnUnmount) sleep(5);
+    ProcessSnapshot snapshot;
+    snapshot.scan();
+    KillProcessesWithOpenFiles(snapshot, path, SIGINT);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
     if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
         return OK;
     }
 
-    KillProcessesWithOpenFiles(path, SIGTERM);
-    if (sSleepOnUnmount) sleep(5);
+    snapshot.refresh(path);
+    KillProcessesWithOpenFiles(snapshot, path, SIGTERM);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
     if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
         return OK;
     }
 
-    KillProcessesWithOpenFiles(path, SIGKILL);
-    if (sSleepOnUnmount) sleep(5);
+    // Last chance, so look for anything that has started using the path since
+    // the first pass too.
+    snapshot.scan();
+    KillProcessesWithOpenFiles(snapshot, path, SIGKILL);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
     if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
         return OK;
     }
@@ -504,51 +510,68 @@ status_t ForceUnmount(const std::string& path) {
     return -errno;
 }
 
+// The processes found by the first pass are looked at again by the next ones,
+// rather than walking /proc each time.  The last pass walks /proc again, in
+// case anything else has started using the path in the meantime.  Between
+// passes, this waits for up to 5 seconds for the processes that were sent a
+// signal to exit, but moves on as soon as they all have.
 status_t KillProcessesWithTmpfsMountPrefix(const std::string& path) {
-    if (KillProcessesWithTmpfsMounts(path, SIGINT) == 0) {
+    ProcessSnapshot snapshot;
+    if (!snapshot.scan(false /* withFiles */)) return -EBUSY;
+    if (KillProcessesWithTmpfsMounts(snapshot, path, SIGINT) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
 
-    if (KillProcessesWithTmpfsMounts(path, SIGTERM) == 0) {
+    snapshot.refresh(path);
+    if (KillProcessesWithTmpfsMounts(snapshot, path, SIGTERM) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
 
-    if (KillProcessesWithTmpfsMounts(path, SIGKILL) == 0) {
+    snapshot.refresh(path);
+    if (KillProcessesWithTmpfsMounts(snapshot, path, SIGKILL) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
 
     // Send SIGKILL a second time to determine if we've
     // actually killed everyone mount
-    if (KillProcessesWithTmpfsMounts(path, SIGKILL) == 0) {
+    if (snapshot.scan(false /* withFiles */) &&
+        KillProcessesWithTmpfsMounts(snapshot, path, SIGKILL) == 0) {
         return OK;
     }
     PLOG(ERROR) << "Failed to kill processes using " << path;
     return -EBUSY;
 }
 
+// Like KillProcessesWithTmpfsMountPrefix(), only walks /proc on the first and
+// last passes.
 status_t KillProcessesUsingPath(const std::string& path) {
-    if (KillProcessesWithOpenFiles(path, SIGINT, false /* killFuseDaemon */) == 0) {
+    ProcessSnapshot snapshot;
+    if (!snapshot.scan()) return -EBUSY;
+    if (KillProcessesWithOpenFiles(snapshot, path, SIGINT, false /* killFuseDaemon */) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
 
-    if (KillProcessesWithOpenFiles(path, SIGTERM, false /* killFuseDaemon */) == 0) {
+    snapshot.refresh(path);
+    if (KillProcessesWithOpenFiles(snapshot, path, SIGTERM, false /* killFuseDaemon */) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
 
-    if (KillProcessesWithOpenFiles(path, SIGKILL, false /* killFuseDaemon */) == 0) {
+    snapshot.refresh(path);
+    if (KillProcessesWithOpenFiles(snapshot, path, SIGKILL, false /* killFuseDaemon */) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    if (sSleepOnUnmount) snapshot.waitForExit(5s);
 
     // Send SIGKILL a second time to determine if we've
     // actually killed everyone with open files
     // This time, we also kill the FUSE daemon if found
-    if (KillProcessesWithOpenFiles(path, SIGKILL, true /* killFuseDaemon */) == 0) {
+    if (snapshot.scan() &&
+        KillProcessesWithOpenFiles(snapshot, path, SIGKILL, true /* killFuseDaemon */) == 0) {
         return OK;
     }
     PLOG(ERROR) << "Failed to kill processes using " << path;
@@ -25,6 +25,7 @@
 #include <private/android_filesystem_config.h>
 #include <utils/Trace.h>
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <fstream>
 #include <thread>
@@ -137,6 +138,18 @@ status_t VoldNativeService::dump(int fd, const Vector<String16>& /* args */) {
 
     ACQUIRE_LOCK;
     dprintf(fd, "vold is happy!\n");
+
+    CheckpointMetrics metrics = cp_getMetrics();
+    dprintf(fd, "\nCheckpoint:\n");
+    dprintf(fd, "  Log: %" PRIu64 " sectors, %" PRIu64 " entries\n", metrics.log_sectors,
+            metrics.log_entries);
+    dprintf(fd, "  Validated: %" PRIu64 " bytes in %" PRId64 "ms\n", metrics.bytes_validated,
+            static_cast<int64_t>(metrics.validate_time.count()));
+    dprintf(fd, "  Restored: %" PRIu64 " bytes in %" PRId64 "ms, %" PRIu32 " restarts\n",
+            metrics.bytes_restored, static_cast<int64_t>(metrics.restore_time.count()),
+            metrics.partial_restore_restarts);
+    dprintf(fd, "  Commit: %" PRId64 "ms\n", static_cast<int64_t>(metrics.commit_time.count()));
+    dprintf(fd, "  Peak space used: %" PRIu64 " bytes\n", metrics.peak_space_used);
     return NO_ERROR;
 }
 
@@ -402,6 +415,24 @@ binder::Status VoldNativeService::unmountAppStorageDirs(int uid, int pid,
             true /* doUnmount */, packageNames));
 }
 
+binder::Status VoldNativeService::remountAppStorageDirsBatch(
+        const std::vector<android::os::AppStorageDirs>& processes) {
+    ENFORCE_SYSTEM_OR_ROOT;
+    ACQUIRE_LOCK;
+
+    return translate(
+            VolumeManager::Instance()->handleAppStorageDirs(processes, false /* doUnmount */));
+}
+
+binder::Status VoldNativeService::unmountAppStorageDirsBatch(
+        const std::vector<android::os::AppStorageDirs>& processes) {
+    ENFORCE_SYSTEM_OR_ROOT;
+    ACQUIRE_LOCK;
+
+    return translate(
+            VolumeManager::Instance()->handleAppStorageDirs(processes, true /* doUnmount */));
+}
+
 binder::Status VoldNativeService::setupAppDir(const std::string& path, int32_t appUid) {
     ENFORCE_SYSTEM_OR_ROOT;
     CHECK_ARGUMENT_PATH(path);
@@ -541,6 +572,73 @@ binder::Status VoldNativeService::getWriteAmount(int32_t* _aidl_return) {
     return Ok();
 }
 
+binder::Status VoldNativeService::getGCUrgentPaceState(
+        android::os::PersistableBundle* _aidl_return) {
+    ENFORCE_SYSTEM_OR_ROOT;
+
+    GCUrgentPaceState state = GetGCUrgentPaceState();
+    _aidl_return->putBoolean(String16("active"), state.active);
+    _aidl_return->putInt(String16("sleep_time_ms"), state.sleep_time_ms);
+    _aidl_return->putInt(String16("target_segments"), state.target_segments);
+    _aidl_return->putInt(String16("reclaimed_segments"), state.reclaimed_segments);
+    _aidl_return->putInt(String16("written_segments"), state.written_segments);
+    _aidl_return->putDouble(String16("reclaim_rate"), state.reclaim_rate);
+    _aidl_return->putDouble(String16("needed_rate"), state.needed_rate);
+    _aidl_return->putInt(String16("dirty_ratio"), state.dirty_ratio);
+    _aidl_return->putInt(String16("target_dirty_ratio"), state.target_dirty_ratio);
+    return Ok();
+}
+
+binder::Status VoldNativeService::getStorageTelemetry(
+        int64_t sinceMs, android::os::PersistableBundle* _aidl_return) {
+    ENFORCE_SYSTEM_OR_ROOT;
+
+    std::vector<int64_t> time_ms, lifetime_write_kbytes;
+    std::vector<int32_t> free_segments, dirty_segments, life_time_a, life_time_b, life_time_c;
+    for (const auto& sample : GetStorageTelemetry(sinceMs)) {
+        time_ms.push_back(sample.time_ms);
+        free_segments.push_back(sample.free_segments);
+        dirty_segments.push_back(sample.dirty_segments);
+        lifetime_write_kbytes.push_back(sample.lifetime_write_kbytes);
+        life_time_a.push_back(sample.life_time_a);
+        life_time_b.push_back(sample.life_time_b);
+        life_time_c.push_back(sample.life_time_c);
+    }
+    _aidl_return->putLongVector(String16("time_ms"), time_ms);
+    _aidl_return->putIntVector(String16("free_segments"), free_segments);
+    _aidl_return->putIntVector(String16("dirty_segments"), dirty_segments);
+    _aidl_return->putLongVector(String16("lifetime_write_kbytes"), lifetime_write_kbytes);
+    _aidl_return->putIntVector(String16("life_time_a"), life_time_a);
+    _aidl_return->putIntVector(String16("life_time_b"), life_time_b);
+    _aidl_return->putIntVector(String16("life_time_c"), life_time_c);
+    return Ok();
+}
+
+binder::Status VoldNativeService::getWriteAccounting(
+        const std::string& consumer, bool reset, android::os::PersistableBundle* _aidl_return) {
+    ENFORCE_SYSTEM_OR_ROOT;
+
+    WriteAccounting accounting;
+    if (!GetWriteAccounting(consumer, reset, &accounting)) {
+        return binder::Status::fromServiceSpecificError(
+                EUSERS, String8(("Too many write accounting consumers for " + consumer).c_str()));
+    }
+    _aidl_return->putLong(String16("window_ms"), accounting.window_ms);
+    _aidl_return->putLong(String16("app_write_kbytes"), accounting.app_write_kbytes);
+    _aidl_return->putLong(String16("fs_write_kbytes"), accounting.fs_write_kbytes);
+    _aidl_return->putDouble(String16("write_amplification"), accounting.write_amplification);
+    _aidl_return->putInt(String16("life_time_a"), accounting.life_time_a);
+    _aidl_return->putInt(String16("life_time_b"), accounting.life_time_b);
+    return Ok();
+}
+
+binder::Status VoldNativeService::removeWriteAccounting(const std::string& consumer) {
+    ENFORCE_SYSTEM_OR_ROOT;
+
+    RemoveWriteAccounting(consumer);
+    return Ok();
+}
+
 binder::Status VoldNativeService::mountAppFuse(int32_t uid, int32_t mountId,
                                                android::base::unique_fd* _aidl_return) {
     ENFORCE_SYSTEM_OR_ROOT;
@@ -597,15 +695,20 @@ binder::Status VoldNativeService::mountFstab(const std::string& blkDevice,
                                                           "null", isZoned, userDevices));
 }
 
-binder::Status VoldNativeService::encryptFstab(const std::string& blkDevice,
-                                               const std::string& mountPoint, bool shouldFormat,
-                                               const std::string& fsType, bool isZoned,
-                                               const std::vector<std::string>& userDevices) {
+binder::Status VoldNativeService::encryptFstab(
+        const std::string& blkDevice, const std::string& mountPoint, bool shouldFormat,
+        const std::string& fsType, bool isZoned, const std::vector<std::string>& userDevices,
+        const android::sp<android::os::IVoldTaskListener>& listener) {
     ENFORCE_SYSTEM_OR_ROOT;
     ACQUIRE_LOCK;
 
-    return translateBool(fscrypt_mount_metadata_encrypted(blkDevice, mountPoint, true, shouldFormat,
-                                                          fsType, isZoned, userDevices));
+    bool success = fscrypt_mount_metadata_encrypted(blkDevice, mountPoint, true, shouldFormat,
+                                                    fsType, isZoned, userDevices, listener);
+    if (listener) {
+        android::os::PersistableBundle extras;
+        listener->onFinished(success ? 0 : -1, extras);
+    }
+    return translateBool(success);
 }
 
 binder::Status VoldNativeService::setStorageBindingSeed(const std::vector<uint8_t>& seed) {
@@ -799,6 +902,23 @@ binder::Status VoldNativeService::resetCheckpoint() {
     return Ok();
 }
 
+binder::Status VoldNativeService::getCheckpointMetrics(
+        android::os::PersistableBundle* _aidl_return) {
+    ENFORCE_SYSTEM_OR_ROOT;
+
+    CheckpointMetrics metrics = cp_getMetrics();
+    _aidl_return->putLong(String16("log_sectors"), metrics.log_sectors);
+    _aidl_return->putLong(String16("log_entries"), metrics.log_entries);
+    _aidl_return->putLong(String16("bytes_validated"), metrics.bytes_validated);
+    _aidl_return->putLong(String16("bytes_restored"), metrics.bytes_restored);
+    _aidl_return->putLong(String16("validate_time_ms"), metrics.validate_time.count());
+    _aidl_return->putLong(String16("restore_time_ms"), metrics.restore_time.count());
+    _aidl_return->putInt(String16("partial_restore_restarts"), metrics.partial_restore_restarts);
+    _aidl_return->putLong(String16("commit_time_ms"), metrics.commit_time.count());
+    _aidl_return->putLong(String16("peak_space_used"), metrics.peak_space_used);
+    return Ok();
+}
+
 static void initializeIncFs() {
     // Obtaining IncFS features triggers initialization of IncFS.
     incfs::features();
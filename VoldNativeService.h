@@ -68,6 +68,10 @@ class VoldNativeService : public BinderService<VoldNativeService>, public os::Bn
                                const std::vector<std::string>& packageNames);
     binder::Status unmountAppStorageDirs(int uid, int pid,
                                const std::vector<std::string>& packageNames);
+    binder::Status remountAppStorageDirsBatch(
+            const std::vector<android::os::AppStorageDirs>& processes);
+    binder::Status unmountAppStorageDirsBatch(
+            const std::vector<android::os::AppStorageDirs>& processes);
 
     binder::Status ensureAppDirsCreated(const std::vector<std::string>& paths, int32_t appUid);
     binder::Status setupAppDir(const std::string& path, int32_t appUid);
@@ -95,6 +99,12 @@ class VoldNativeService : public BinderService<VoldNativeService>, public os::Bn
                                    int32_t minGCSleepTime, int32_t targetDirtyRatio);
     binder::Status refreshLatestWrite();
     binder::Status getWriteAmount(int32_t* _aidl_return);
+    binder::Status getGCUrgentPaceState(android::os::PersistableBundle* _aidl_return);
+    binder::Status getStorageTelemetry(int64_t sinceMs,
+                                       android::os::PersistableBundle* _aidl_return);
+    binder::Status getWriteAccounting(const std::string& consumer, bool reset,
+                                      android::os::PersistableBundle* _aidl_return);
+    binder::Status removeWriteAccounting(const std::string& consumer);
 
     binder::Status mountAppFuse(int32_t uid, int32_t mountId,
                                 android::base::unique_fd* _aidl_return);
@@ -109,7 +119,8 @@ class VoldNativeService : public BinderService<VoldNativeService>, public os::Bn
                               bool isZoned, const std::vector<std::string>& userDevices);
     binder::Status encryptFstab(const std::string& blkDevice, const std::string& mountPoint,
                                 bool shouldFormat, const std::string& fsType, bool isZoned,
-                                const std::vector<std::string>& userDevices);
+                                const std::vector<std::string>& userDevices,
+                                const android::sp<android::os::IVoldTaskListener>& listener);
 
     binder::Status setStorageBindingSeed(const std::vector<uint8_t>& seed);
 
@@ -146,6 +157,7 @@ class VoldNativeService : public BinderService<VoldNativeService>, public os::Bn
     binder::Status supportsBlockCheckpoint(bool* _aidl_return);
     binder::Status supportsFileCheckpoint(bool* _aidl_return);
     binder::Status resetCheckpoint();
+    binder::Status getCheckpointMetrics(android::os::PersistableBundle* _aidl_return);
 
     binder::Status earlyBootEnded();
 
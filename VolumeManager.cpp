@@ -32,6 +32,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <array>
+#include <map>
 
 #include <linux/kdev_t.h>
 
@@ -805,76 +806,57 @@ static std::string getStorageDirTarget(userid_t userId, std::string dirName,
 // Fork the process and remount / unmount app data and obb dirs
 bool VolumeManager::forkAndRemountStorage(int uid, int pid, bool doUnmount,
                                           const std::vector<std::string>& packageNames) {
-    userid_t userId = multiuser_get_user_id(uid);
-    std::string mnt_path = StringPrintf("/proc/%d/ns/mnt", pid);
-    android::base::unique_fd nsFd(
-            TEMP_FAILURE_RETRY(open(mnt_path.c_str(), O_RDONLY | O_CLOEXEC)));
-    if (nsFd == -1) {
-        PLOG(ERROR) << "Unable to open " << mnt_path.c_str();
-        return false;
-    }
-    // Storing both Android/obb and Android/data paths.
-    int size = packageNames.size() * 2;
-
-    std::unique_ptr<std::string[]> sources(new std::string[size]);
-    std::unique_ptr<std::string[]> targets(new std::string[size]);
-    std::unique_ptr<const char*[]> sources_uptr(new const char*[size]);
-    std::unique_ptr<const char*[]> targets_uptr(new const char*[size]);
-    const char** sources_cstr = sources_uptr.get();
-    const char** targets_cstr = targets_uptr.get();
+    android::os::AppStorageDirs process;
+    process.uid = uid;
+    process.pid = pid;
+    process.packageNames = packageNames;
+    return forkAndRemountStorage({process}, doUnmount);
+}
 
-    for (int i = 0; i < size; i += 2) {
-        std::string const& packageName = packageNames[i/2];
-        sources[i] = getStorageDirSrc(userId, "Android/data", packageName);
-        targets[i] = getStorageDirTarget(userId, "Android/data", packageName);
-        sources[i+1] = getStorageDirSrc(userId, "Android/obb", packageName);
-        targets[i+1] = getStorageDirTarget(userId, "Android/obb", packageName);
+// The most mount namespaces that forkAndRemountStorage() keeps open for a
+// single forked child.
+static const size_t kMaxNamespacesPerChild = 128;
+
+// The mounts to change in the namespace of an app process, all set up before
+// forking.
+struct AppStorageMounts {
+    int uid;
+    android::base::unique_fd nsFd;
+    std::string androidDataDir;
+    std::string androidObbDir;
+    // Storing both Android/obb and Android/data paths.
+    std::vector<std::string> sources;
+    std::vector<std::string> targets;
+    std::vector<const char*> sourcesCstr;
+    std::vector<const char*> targetsCstr;
+};
 
-        sources_cstr[i] = sources[i].c_str();
-        targets_cstr[i] = targets[i].c_str();
-        sources_cstr[i+1] = sources[i+1].c_str();
-        targets_cstr[i+1] = targets[i+1].c_str();
+// Fork a single child to remount / unmount the app data and obb dirs of each of
+// |mounts| in turn
+static bool forkAndRemountStorageDirs(std::vector<AppStorageMounts>& mounts, bool doUnmount) {
+    for (auto& m : mounts) {
+        for (const auto& source : m.sources) m.sourcesCstr.push_back(source.c_str());
+        for (const auto& target : m.targets) m.targetsCstr.push_back(target.c_str());
     }
 
-    for (int i = 0; i < size; i++) {
-        // Make sure /storage/emulated/... paths are setup correctly
-        // This needs to be done before EnsureDirExists to ensure Android/ is created.
-        auto status = setupAppDir(targets_cstr[i], uid, false /* fixupExistingOnly */);
-        if (status != OK) {
-            PLOG(ERROR) << "Failed to create dir: " << targets_cstr[i];
-            return false;
-        }
-        status = EnsureDirExists(sources_cstr[i], 0771, AID_MEDIA_RW, AID_MEDIA_RW);
-        if (status != OK) {
-            PLOG(ERROR) << "Failed to create dir: " << sources_cstr[i];
-            return false;
-        }
-    }
-
-    char android_data_dir[PATH_MAX];
-    char android_obb_dir[PATH_MAX];
-    snprintf(android_data_dir, PATH_MAX, "/storage/emulated/%d/Android/data", userId);
-    snprintf(android_obb_dir, PATH_MAX, "/storage/emulated/%d/Android/obb", userId);
-
     pid_t child;
     // Fork a child to mount Android/obb android Android/data dirs, as we don't want it to affect
     // original vold process mount namespace.
     if (!(child = fork())) {
-        if (doUnmount) {
-            if (umountStorageDirs(nsFd, android_data_dir, android_obb_dir, uid,
-                    targets_cstr, size)) {
-                _exit(0);
-            } else {
-                _exit(1);
-            }
-        } else {
-            if (remountStorageDirs(nsFd, android_data_dir, android_obb_dir, uid,
-                    sources_cstr, targets_cstr, size)) {
-                _exit(0);
+        bool success = true;
+        for (auto& m : mounts) {
+            if (doUnmount) {
+                success &= umountStorageDirs(m.nsFd, m.androidDataDir.c_str(),
+                                             m.androidObbDir.c_str(), m.uid,
+                                             m.targetsCstr.data(), m.targetsCstr.size());
             } else {
-                _exit(1);
+                success &= remountStorageDirs(m.nsFd, m.androidDataDir.c_str(),
+                                              m.androidObbDir.c_str(), m.uid,
+                                              m.sourcesCstr.data(), m.targetsCstr.data(),
+                                              m.targetsCstr.size());
             }
         }
+        _exit(success ? 0 : 1);
     }
 
     if (child == -1) {
@@ -898,22 +880,107 @@ bool VolumeManager::forkAndRemountStorage(int uid, int pid, bool doUnmount,
     return true;
 }
 
+// Remount / unmount the app data and obb dirs of several processes.  Each dir
+// is only set up once, however many of the processes it's for, and the mounts
+// are changed by one child per kMaxNamespacesPerChild processes.
+bool VolumeManager::forkAndRemountStorage(
+        const std::vector<android::os::AppStorageDirs>& processes, bool doUnmount) {
+    bool result = true;
+    std::set<std::pair<std::string, int>> preparedDirs;
+    std::vector<AppStorageMounts> mounts;
+    for (const auto& process : processes) {
+        userid_t userId = multiuser_get_user_id(process.uid);
+        std::string mnt_path = StringPrintf("/proc/%d/ns/mnt", process.pid);
+        android::base::unique_fd nsFd(
+                TEMP_FAILURE_RETRY(open(mnt_path.c_str(), O_RDONLY | O_CLOEXEC)));
+        if (nsFd == -1) {
+            PLOG(ERROR) << "Unable to open " << mnt_path.c_str();
+            result = false;
+            continue;
+        }
+
+        AppStorageMounts m;
+        m.uid = process.uid;
+        m.nsFd = std::move(nsFd);
+        m.androidDataDir = StringPrintf("/storage/emulated/%d/Android/data", userId);
+        m.androidObbDir = StringPrintf("/storage/emulated/%d/Android/obb", userId);
+        for (const auto& packageName : process.packageNames) {
+            m.sources.push_back(getStorageDirSrc(userId, "Android/data", packageName));
+            m.targets.push_back(getStorageDirTarget(userId, "Android/data", packageName));
+            m.sources.push_back(getStorageDirSrc(userId, "Android/obb", packageName));
+            m.targets.push_back(getStorageDirTarget(userId, "Android/obb", packageName));
+        }
+
+        bool prepared = true;
+        for (size_t j = 0; j < m.targets.size() && prepared; j++) {
+            auto key = std::make_pair(m.targets[j], process.uid);
+            if (preparedDirs.count(key) != 0) continue;
+            // Make sure /storage/emulated/... paths are setup correctly
+            // This needs to be done before EnsureDirExists to ensure Android/ is created.
+            auto status = setupAppDir(m.targets[j], process.uid, false /* fixupExistingOnly */);
+            if (status != OK) {
+                PLOG(ERROR) << "Failed to create dir: " << m.targets[j];
+                prepared = false;
+                break;
+            }
+            status = EnsureDirExists(m.sources[j], 0771, AID_MEDIA_RW, AID_MEDIA_RW);
+            if (status != OK) {
+                PLOG(ERROR) << "Failed to create dir: " << m.sources[j];
+                prepared = false;
+                break;
+            }
+            preparedDirs.insert(std::move(key));
+        }
+        if (prepared) {
+            mounts.push_back(std::move(m));
+        } else {
+            result = false;
+        }
+
+        if (mounts.size() >= kMaxNamespacesPerChild) {
+            result &= forkAndRemountStorageDirs(mounts, doUnmount);
+            mounts.clear();
+        }
+    }
+    if (!mounts.empty()) result &= forkAndRemountStorageDirs(mounts, doUnmount);
+    return result;
+}
+
 int VolumeManager::handleAppStorageDirs(int uid, int pid,
         bool doUnmount, const std::vector<std::string>& packageNames) {
+    android::os::AppStorageDirs process;
+    process.uid = uid;
+    process.pid = pid;
+    process.packageNames = packageNames;
+    return handleAppStorageDirs({process}, doUnmount);
+}
+
+int VolumeManager::handleAppStorageDirs(
+        const std::vector<android::os::AppStorageDirs>& processes, bool doUnmount) {
     // Only run the remount if fuse is mounted for that user.
-    userid_t userId = multiuser_get_user_id(uid);
-    bool fuseMounted = false;
-    for (auto& vol : mInternalEmulatedVolumes) {
-        if (vol->getMountUserId() == userId && vol->getState() == VolumeBase::State::kMounted) {
-            auto* emulatedVol = static_cast<android::vold::EmulatedVolume*>(vol.get());
-            if (emulatedVol) {
-                fuseMounted = emulatedVol->isFuseMounted();
+    std::map<userid_t, bool> fuseMountedUsers;
+    std::vector<android::os::AppStorageDirs> fuseMountedProcesses;
+    for (const auto& process : processes) {
+        userid_t userId = multiuser_get_user_id(process.uid);
+        auto it = fuseMountedUsers.find(userId);
+        if (it == fuseMountedUsers.end()) {
+            bool fuseMounted = false;
+            for (auto& vol : mInternalEmulatedVolumes) {
+                if (vol->getMountUserId() == userId &&
+                    vol->getState() == VolumeBase::State::kMounted) {
+                    auto* emulatedVol = static_cast<android::vold::EmulatedVolume*>(vol.get());
+                    if (emulatedVol) {
+                        fuseMounted = emulatedVol->isFuseMounted();
+                    }
+                    break;
+                }
             }
-            break;
+            it = fuseMountedUsers.emplace(userId, fuseMounted).first;
         }
+        if (it->second) fuseMountedProcesses.push_back(process);
     }
-    if (fuseMounted) {
-        forkAndRemountStorage(uid, pid, doUnmount, packageNames);
+    if (!fuseMountedProcesses.empty()) {
+        forkAndRemountStorage(fuseMountedProcesses, doUnmount);
     }
     return 0;
 }
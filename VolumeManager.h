@@ -34,6 +34,7 @@
 #include <utils/List.h>
 #include <utils/Timers.h>
 
+#include "android/os/AppStorageDirs.h"
 #include "android/os/IVoldListener.h"
 
 #include "model/Disk.h"
@@ -128,6 +129,8 @@ class VolumeManager {
     int remountUid(uid_t uid, int32_t remountMode) { return 0; }
     int handleAppStorageDirs(int uid, int pid,
             bool doUnmount, const std::vector<std::string>& packageNames);
+    int handleAppStorageDirs(const std::vector<android::os::AppStorageDirs>& processes,
+                             bool doUnmount);
 
     /* Aborts all FUSE filesystems, in case the FUSE daemon is no longer up. */
     int abortFuse();
@@ -143,6 +146,8 @@ class VolumeManager {
 
     bool forkAndRemountStorage(int uid, int pid, bool doUnmount,
         const std::vector<std::string>& packageNames);
+    bool forkAndRemountStorage(const std::vector<android::os::AppStorageDirs>& processes,
+                               bool doUnmount);
 
     static VolumeManager* Instance();
 
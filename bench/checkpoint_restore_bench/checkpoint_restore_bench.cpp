@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures cp_restoreCheckpoint() and checks its results without needing a
+// real dm-bow device.  A simulated dm-bow log is generated into an image file,
+// which is then restored.  The validation pass is timed on its own by stopping
+// the restore after its first entry, and then the whole restore is timed on a
+// freshly generated image.  Optionally, the restore is also run as a series of
+// runs interrupted at random points, as after power loss.  Either way, the
+// restored image is checked against the content from before the checkpoint.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/unique_fd.h>
+
+#include "Checkpoint.h"
+#include "dm_bow_log_generator.h"
+
+using android::base::unique_fd;
+using android::vold::DmBowLogGenerator;
+using android::vold::DmBowLogOptions;
+using android::vold::WritePattern;
+
+static constexpr char VERSION[] = "0";
+
+struct Options {
+    std::string work_dir = "/data/local/tmp";
+    DmBowLogOptions log;
+    // If nonzero, the restore is also run interrupted after a random number of
+    // entries, up to this many, each time.
+    int max_restore_limit = 0;
+};
+
+static void usage(std::ostream& ostr, const std::string& program_name) {
+    Options options;
+    ostr << "Usage: " << program_name << " [options]\n";
+    ostr << "\t-w DIR\t\t: Directory for the image file (default " << options.work_dir
+         << ").\n";
+    ostr << "\t-b BLOCKS\t: Size of the image in 4096-byte blocks (default " << options.log.blocks
+         << ").\n";
+    ostr << "\t-n WRITES\t: Block writes during the checkpoint (default " << options.log.writes
+         << ").\n";
+    ostr << "\t-f PERCENT\t: Blocks free for backups at the start (default "
+         << options.log.free_percent << ").\n";
+    ostr << "\t-c PERCENT\t: Rewrites that discard the block, causing collisions (default "
+         << options.log.discard_percent << ").\n";
+    ostr << "\t-m PERCENT\t: Backups of adjacent blocks merged into one entry (default "
+         << options.log.merge_percent << ").\n";
+    ostr << "\t-p PATTERN\t: Write pattern, sequential, random or hot (default sequential).\n";
+    ostr << "\t-s SEED\t\t: Random seed (default " << options.log.seed << ").\n";
+    ostr << "\t-r LIMIT\t: Also restore in runs interrupted after at most LIMIT entries.\n"
+         << "\t\t\t  Restore only saves its progress on a collision and at the start of\n"
+         << "\t\t\t  each log sector, so LIMIT must be at least the number of entries\n"
+         << "\t\t\t  between those points (up to a whole log sector with -c 0).\n";
+}
+
+static void report_metric(const std::string& metric, double value, const std::string& unit) {
+    std::cout << VERSION << ";" << metric << ";" << value << ";" << unit << std::endl;
+}
+
+// cp_restoreCheckpoint() logs every log sector, and every interruption as an
+// error, so its logging is hidden; the benchmark's own errors are still shown.
+static android::binder::Status restore(const std::string& image, int count = 0) {
+    android::base::ScopedLogSeverity quiet(android::base::FATAL);
+    return android::vold::cp_restoreCheckpoint(image, count);
+}
+
+static bool is_interrupted(const android::binder::Status& status) {
+    return status.serviceSpecificErrorCode() == EAGAIN;
+}
+
+// Generates the image afresh, so that every run starts from the same log.
+static bool generate(const std::string& image, const Options& options,
+                     std::unique_ptr<DmBowLogGenerator>* generator) {
+    unique_fd fd(open(image.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd < 0) {
+        PLOG(ERROR) << "Failed to create " << image;
+        return false;
+    }
+    *generator = std::make_unique<DmBowLogGenerator>(options.log);
+    if (!(*generator)->Generate(fd)) return false;
+    if (fsync(fd) != 0) {
+        PLOG(ERROR) << "Failed to sync " << image;
+        return false;
+    }
+    // Start from a cold page cache, as on boot.
+    android::base::WriteStringToFile("3", "/proc/sys/vm/drop_caches");
+    return true;
+}
+
+// Reads the first sector of the image, which is where an interrupted restore
+// saves the point it will resume from.  A run that leaves it unchanged made no
+// progress.
+static bool read_restore_point(const std::string& image, std::string* point) {
+    unique_fd fd(open(image.c_str(), O_RDONLY | O_CLOEXEC));
+    point->resize(512);
+    if (fd < 0 || !android::base::ReadFully(fd, point->data(), point->size())) {
+        PLOG(ERROR) << "Failed to read " << image;
+        return false;
+    }
+    return true;
+}
+
+static bool verify(const std::string& image, DmBowLogGenerator* generator) {
+    unique_fd fd(open(image.c_str(), O_RDONLY | O_CLOEXEC));
+    uint64_t bad_block;
+    if (fd < 0 || !generator->Verify(fd, &bad_block)) {
+        LOG(ERROR) << "Restored image doesn't match at block " << bad_block;
+        return false;
+    }
+    return true;
+}
+
+static bool run_benchmark(const std::string& image, const Options& options) {
+    std::unique_ptr<DmBowLogGenerator> generator;
+
+    // Validation, plus restoring a single entry.
+    if (!generate(image, options, &generator)) return false;
+    auto start = std::chrono::steady_clock::now();
+    auto status = restore(image, 1);
+    std::chrono::duration<double> validate_time = std::chrono::steady_clock::now() - start;
+    if (!status.isOk() && !is_interrupted(status)) {
+        LOG(ERROR) << "Validation failed: " << status.toString8();
+        return false;
+    }
+
+    // The whole restore.
+    if (!generate(image, options, &generator)) return false;
+    start = std::chrono::steady_clock::now();
+    status = restore(image);
+    std::chrono::duration<double> total_time = std::chrono::steady_clock::now() - start;
+    if (!status.isOk()) {
+        LOG(ERROR) << "Restore failed: " << status.toString8();
+        return false;
+    }
+    if (!verify(image, generator.get())) return false;
+
+    double restore_seconds = std::max(0.0, total_time.count() - validate_time.count());
+    report_metric("log_entries", generator->num_entries(), "entries");
+    report_metric("log_sectors", generator->num_log_sectors(), "sectors");
+    report_metric("logged_bytes", generator->logged_bytes(), "B");
+    report_metric("validate_time", validate_time.count() * 1000, "ms");
+    report_metric("restore_time", restore_seconds * 1000, "ms");
+    report_metric("total_time", total_time.count() * 1000, "ms");
+    report_metric("restore_throughput",
+                  generator->logged_bytes() / (1024.0 * 1024.0) / total_time.count(), "MiB/s");
+
+    if (options.max_restore_limit == 0) return true;
+
+    // The restore again, interrupted at random points.  A run that saves no
+    // progress is retried with the largest limit, and if that doesn't save any
+    // either, no run ever will.
+    if (!generate(image, options, &generator)) return false;
+    std::string point;
+    if (!read_restore_point(image, &point)) return false;
+    std::mt19937 rng(options.log.seed);
+    int restarts = 0;
+    bool stalled = false;
+    for (;;) {
+        int limit = stalled ? options.max_restore_limit : 1 + rng() % options.max_restore_limit;
+        status = restore(image, limit);
+        if (status.isOk()) break;
+        if (!is_interrupted(status)) {
+            LOG(ERROR) << "Restore failed after " << restarts
+                       << " restarts: " << status.toString8();
+            return false;
+        }
+        restarts++;
+
+        std::string new_point;
+        if (!read_restore_point(image, &new_point)) return false;
+        stalled = new_point == point;
+        if (stalled && limit == options.max_restore_limit) {
+            LOG(ERROR) << "Restore makes no progress in runs of " << limit
+                       << " entries; use a larger -r LIMIT";
+            return false;
+        }
+        point = std::move(new_point);
+    }
+    if (!verify(image, generator.get())) return false;
+    report_metric("restarts", restarts, "restarts");
+    return true;
+}
+
+int main(int argc, char** argv) {
+    android::base::InitLogging(argv, android::base::StderrLogger);
+
+    Options options;
+    std::string pattern;
+    int c;
+    while ((c = getopt(argc, argv, "w:b:n:f:c:m:p:s:r:h")) != -1) {
+        bool ok = true;
+        switch (c) {
+            case 'w':
+                options.work_dir = optarg;
+                break;
+            case 'b':
+                ok = android::base::ParseUint(optarg, &options.log.blocks, uint64_t(1) << 32) &&
+                     options.log.blocks >= 2;
+                break;
+            case 'n':
+                ok = android::base::ParseUint(optarg, &options.log.writes);
+                break;
+            case 'f':
+                ok = android::base::ParseUint(optarg, &options.log.free_percent, 99u);
+                break;
+            case 'c':
+                ok = android::base::ParseUint(optarg, &options.log.discard_percent, 100u);
+                break;
+            case 'm':
+                ok = android::base::ParseUint(optarg, &options.log.merge_percent, 100u);
+                break;
+            case 'p':
+                pattern = optarg;
+                if (pattern == "sequential")
+                    options.log.pattern = WritePattern::kSequential;
+                else if (pattern == "random")
+                    options.log.pattern = WritePattern::kRandom;
+                else if (pattern == "hot")
+                    options.log.pattern = WritePattern::kHot;
+                else
+                    ok = false;
+                break;
+            case 's':
+                ok = android::base::ParseUint(optarg, &options.log.seed);
+                break;
+            case 'r':
+                ok = android::base::ParseInt(optarg, &options.max_restore_limit, 1);
+                break;
+            case 'h':
+                usage(std::cout, argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            usage(std::cerr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string image = options.work_dir + "/checkpoint_restore_bench.img";
+    bool success = run_benchmark(image, options);
+    unlink(image.c_str());
+    if (!success) {
+        std::cerr << "Benchmark failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
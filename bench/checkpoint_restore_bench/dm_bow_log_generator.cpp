@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dm_bow_log_generator.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+#include "Crc32.h"
+
+namespace android {
+namespace vold {
+
+// Number of blocks read or written at once.
+static constexpr uint64_t kIoBlocks = 256;
+
+DmBowLogGenerator::DmBowLogGenerator(const DmBowLogOptions& options)
+    : options_(options),
+      sectors_per_block_(options.block_size / kSectorSize),
+      max_entries_((options.block_size - sizeof(LogSector)) / sizeof(LogEntry)),
+      rng_(options.seed),
+      buf_(options.block_size) {}
+
+bool DmBowLogGenerator::Percent(unsigned int percent) {
+    return rng_() % 100 < percent;
+}
+
+// Returns the next block for the filesystem to write.  Block 0 holds the log,
+// so it's never written.
+uint64_t DmBowLogGenerator::NextBlock(uint64_t prev) {
+    uint64_t random = 1 + rng_() % (options_.blocks - 1);
+    switch (options_.pattern) {
+        case WritePattern::kSequential:
+            if (rng_() % 16 == 0) return random;
+            return prev + 1 < options_.blocks ? prev + 1 : 1;
+        case WritePattern::kRandom:
+            return random;
+        case WritePattern::kHot: {
+            uint64_t hot_blocks = std::max<uint64_t>(options_.blocks / 16, 1);
+            if (rng_() % 10 != 0) return 1 + rng_() % hot_blocks;
+            return random;
+        }
+    }
+    return random;
+}
+
+void DmBowLogGenerator::FillBlock(uint64_t token, uint8_t* buf) {
+    if (token & kLogSectorToken) {
+        memcpy(buf, log_sectors_[token & ~kLogSectorToken].data(), options_.block_size);
+        return;
+    }
+    // splitmix64, seeded from the token.
+    uint64_t x = token * 0x9e3779b97f4a7c15ULL ^ options_.seed;
+    for (uint32_t i = 0; i < options_.block_size; i += sizeof(uint64_t)) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        memcpy(buf + i, &z, sizeof(z));
+    }
+}
+
+uint32_t DmBowLogGenerator::BlockCrc(uint64_t token, uint32_t crc) {
+    FillBlock(token, buf_.data());
+    return Crc32(crc, buf_.data(), options_.block_size);
+}
+
+// dm-bow backs up to the free blocks in order.
+bool DmBowLogGenerator::Allocate(uint64_t* block) {
+    if (free_blocks_.empty()) return false;
+    *block = *free_blocks_.begin();
+    free_blocks_.erase(free_blocks_.begin());
+    return true;
+}
+
+// Copies |block| to a free block before the filesystem overwrites it.
+bool DmBowLogGenerator::BackUp(uint64_t block, bool merge) {
+    uint64_t backup;
+    if (!Allocate(&backup)) return false;
+    tokens_[backup] = tokens_[block];
+    roles_[backup] = Role::kBackup;
+    return AddEntry(block, backup, merge);
+}
+
+std::vector<uint8_t> DmBowLogGenerator::CurrentLogSector() {
+    std::vector<uint8_t> data(options_.block_size);
+    LogSector ls = {kMagic,    1,         sizeof(LogSector), options_.block_size,
+                    static_cast<uint32_t>(entries_.size()), sequence_, sector0_};
+    memcpy(data.data(), &ls, sizeof(ls));
+    memcpy(data.data() + sizeof(ls), entries_.data(), entries_.size() * sizeof(LogEntry));
+    return data;
+}
+
+bool DmBowLogGenerator::AddEntry(uint64_t source, uint64_t dest, bool merge) {
+    uint64_t source_sector = source * sectors_per_block_;
+    uint64_t dest_sector = dest * sectors_per_block_;
+    logged_bytes_ += options_.block_size;
+
+    // Extend the previous entry if both its source and dest are adjacent, as
+    // long as the two don't overlap.
+    if (merge && entries_.size() > 1) {
+        LogEntry& last = entries_.back();
+        uint64_t sectors = last.size / kSectorSize;
+        if (last.source + sectors == source_sector && last.dest + sectors == dest_sector &&
+            (source_sector < last.dest || source_sector >= last.dest + sectors) &&
+            (dest_sector < last.source || dest_sector >= last.source + sectors)) {
+            last.size += options_.block_size;
+            last.checksum = BlockCrc(tokens_[dest], last.checksum);
+            return true;
+        }
+    }
+
+    // When the log sector is full, it gets backed up like any other block, and
+    // that backup is the first entry of the next one.
+    if (entries_.size() == max_entries_) {
+        uint64_t backup;
+        if (!Allocate(&backup)) return false;
+        log_sectors_.push_back(CurrentLogSector());
+        tokens_[backup] = kLogSectorToken | (log_sectors_.size() - 1);
+        roles_[backup] = Role::kBackup;
+        entries_.clear();
+        sequence_++;
+        entries_.push_back({0, backup * sectors_per_block_, options_.block_size,
+                            BlockCrc(tokens_[backup], 0)});
+        num_entries_++;
+        logged_bytes_ += options_.block_size;
+    }
+
+    entries_.push_back({source_sector, dest_sector, options_.block_size,
+                        BlockCrc(tokens_[dest], static_cast<uint32_t>(source))});
+    num_entries_++;
+    return true;
+}
+
+bool DmBowLogGenerator::Generate(int fd) {
+    if (options_.blocks < 2 || options_.block_size % kSectorSize != 0 ||
+        options_.block_size < sizeof(LogSector) + sizeof(LogEntry)) {
+        LOG(ERROR) << "Invalid image geometry";
+        return false;
+    }
+
+    tokens_.resize(options_.blocks);
+    roles_.resize(options_.blocks);
+    was_in_use_.resize(options_.blocks);
+    for (uint64_t block = 0; block < options_.blocks; block++) {
+        tokens_[block] = block + 1;
+        roles_[block] = Role::kOriginal;
+        if (block != 0 && Percent(options_.free_percent)) {
+            roles_[block] = Role::kFree;
+            free_blocks_.insert(block);
+        }
+        was_in_use_[block] = roles_[block] != Role::kFree;
+    }
+    next_token_ = options_.blocks + 1;
+
+    // The log lives in block 0, so its original content gets backed up first.
+    // Restoring the first entry of the first log sector puts it back.
+    uint64_t backup;
+    if (!Allocate(&backup)) {
+        LOG(ERROR) << "No free blocks to back up to";
+        return false;
+    }
+    tokens_[backup] = tokens_[0];
+    roles_[backup] = Role::kBackup;
+    sector0_ = backup * sectors_per_block_;
+    AddEntry(0, backup, false);
+
+    uint64_t block = 0;
+    for (uint64_t i = 0; i < options_.writes; i++) {
+        block = NextBlock(block);
+        switch (roles_[block]) {
+            case Role::kOriginal:
+            case Role::kBackup:
+                if (!BackUp(block, Percent(options_.merge_percent))) {
+                    LOG(WARNING) << "Ran out of free blocks after " << i << " writes";
+                    i = options_.writes;
+                    continue;
+                }
+                break;
+            case Role::kFree:
+                free_blocks_.erase(block);
+                break;
+            case Role::kWritten:
+                if (Percent(options_.discard_percent)) {
+                    roles_[block] = Role::kFree;
+                    free_blocks_.insert(block);
+                    continue;
+                }
+                break;
+        }
+        tokens_[block] = next_token_++;
+        roles_[block] = Role::kWritten;
+    }
+    log_sectors_.push_back(CurrentLogSector());
+    tokens_[0] = kLogSectorToken | (log_sectors_.size() - 1);
+
+    if (ftruncate(fd, options_.blocks * options_.block_size) != 0) {
+        PLOG(ERROR) << "Failed to size image";
+        return false;
+    }
+    std::vector<uint8_t> buf(kIoBlocks * options_.block_size);
+    for (uint64_t first = 0; first < options_.blocks; first += kIoBlocks) {
+        uint64_t count = std::min(kIoBlocks, options_.blocks - first);
+        for (uint64_t i = 0; i < count; i++)
+            FillBlock(tokens_[first + i], &buf[i * options_.block_size]);
+        if (!android::base::WriteFullyAtOffset(fd, buf.data(), count * options_.block_size,
+                                               first * options_.block_size)) {
+            PLOG(ERROR) << "Failed to write image";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DmBowLogGenerator::Verify(int fd, uint64_t* bad_block) {
+    std::vector<uint8_t> buf(kIoBlocks * options_.block_size);
+    for (uint64_t first = 0; first < options_.blocks; first += kIoBlocks) {
+        uint64_t count = std::min(kIoBlocks, options_.blocks - first);
+        if (!android::base::ReadFullyAtOffset(fd, buf.data(), count * options_.block_size,
+                                              first * options_.block_size)) {
+            PLOG(ERROR) << "Failed to read image";
+            *bad_block = first;
+            return false;
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            if (!was_in_use_[first + i]) continue;
+            FillBlock(first + i + 1, buf_.data());
+            if (memcmp(buf_.data(), &buf[i * options_.block_size], options_.block_size) != 0) {
+                *bad_block = first + i;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+}  // namespace vold
+}  // namespace android
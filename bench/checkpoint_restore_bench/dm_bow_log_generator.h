@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_DM_BOW_LOG_GENERATOR_H
+#define ANDROID_VOLD_DM_BOW_LOG_GENERATOR_H
+
+#include <stdint.h>
+
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+// Which blocks the filesystem writes to during the simulated checkpoint.
+enum class WritePattern {
+    kSequential,  // Mostly in order, with occasional jumps
+    kRandom,      // Uniformly at random
+    kHot,         // Mostly rewriting a small set of blocks, which makes long
+                  // chains of backups being moved
+};
+
+struct DmBowLogOptions {
+    uint64_t blocks = 65536;
+    uint32_t block_size = 4096;
+    // Number of block writes made by the filesystem during the checkpoint.
+    uint64_t writes = 100000;
+    // Percentage of blocks that were free (trimmed) when the checkpoint
+    // started, which dm-bow uses to back up overwritten blocks.
+    unsigned int free_percent = 40;
+    // Percentage of rewrites of a block that also discard it, so that dm-bow
+    // can reuse it for backups.  Restoring over a block that has been backed
+    // up to is a collision, so this controls how often restore has to save
+    // its progress.
+    unsigned int discard_percent = 5;
+    // Percentage of backups of adjacent blocks that get merged into one log
+    // entry.
+    unsigned int merge_percent = 50;
+    WritePattern pattern = WritePattern::kSequential;
+    uint32_t seed = 1;
+};
+
+// Simulates dm-bow during a checkpoint, to produce an image holding a valid
+// log that cp_restoreCheckpoint() can restore.  The content of every block is
+// generated from a token, so the image doesn't have to fit in memory.
+class DmBowLogGenerator {
+  public:
+    explicit DmBowLogGenerator(const DmBowLogOptions& options);
+
+    // Simulates the checkpoint and writes the resulting image to |fd|.
+    bool Generate(int fd);
+
+    // Checks that every block of the image in |fd| that was in use before the
+    // checkpoint has its content from then.  On a mismatch, returns false and
+    // sets |bad_block|.
+    bool Verify(int fd, uint64_t* bad_block);
+
+    uint64_t num_entries() const { return num_entries_; }
+    uint32_t num_log_sectors() const { return sequence_ + 1; }
+    // Bytes of data that restoring the log copies back.
+    uint64_t logged_bytes() const { return logged_bytes_; }
+
+  private:
+    enum class Role : uint8_t {
+        kOriginal,  // Still has its content from before the checkpoint
+        kFree,      // Free for dm-bow to back up blocks to
+        kBackup,    // Holds a backup of another block
+        kWritten,   // Written during the checkpoint, so no longer needs backing up
+    };
+
+    // On-disk format of the dm-bow log, as read by Checkpoint.cpp.
+    struct LogSector {
+        uint32_t magic;
+        uint16_t header_version;
+        uint16_t header_size;
+        uint32_t block_size;
+        uint32_t count;
+        uint32_t sequence;
+        uint64_t sector0;
+    } __attribute__((packed));
+    struct LogEntry {
+        uint64_t source;
+        uint64_t dest;
+        uint32_t size;
+        uint32_t checksum;
+    } __attribute__((packed));
+
+    static constexpr uint32_t kMagic = 0x00574f42;
+    static constexpr int kSectorSize = 512;
+    // Tokens with this bit set are log sectors, indexing |log_sectors_|.
+    static constexpr uint64_t kLogSectorToken = 1ULL << 63;
+
+    bool Percent(unsigned int percent);
+    uint64_t NextBlock(uint64_t prev);
+    void FillBlock(uint64_t token, uint8_t* buf);
+    uint32_t BlockCrc(uint64_t token, uint32_t crc);
+    bool Allocate(uint64_t* block);
+    bool BackUp(uint64_t block, bool merge);
+    bool AddEntry(uint64_t source, uint64_t dest, bool merge);
+    std::vector<uint8_t> CurrentLogSector();
+
+    DmBowLogOptions options_;
+    uint32_t sectors_per_block_;
+    uint32_t max_entries_;
+    std::mt19937_64 rng_;
+    std::vector<uint8_t> buf_;
+
+    std::vector<uint64_t> tokens_;
+    std::vector<Role> roles_;
+    std::vector<bool> was_in_use_;
+    std::set<uint64_t> free_blocks_;
+    uint64_t next_token_;
+    std::vector<std::vector<uint8_t>> log_sectors_;
+
+    std::vector<LogEntry> entries_;
+    uint32_t sequence_ = 0;
+    uint64_t sector0_ = 0;
+    uint64_t num_entries_ = 0;
+    uint64_t logged_bytes_ = 0;
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the throughput of encrypt_inplace() without needing a real device
+// to convert.  An image file is attached via a loop device, formatted as ext4
+// or f2fs and filled to the requested ratio, optionally leaving the used blocks
+// fragmented.  A dm-crypt or dm-linear device is then stacked on the loop
+// device, and the filesystem is encrypted in-place through it.  By default this
+// is done twice, without and then with saving progress as MetadataCrypt does,
+// with the filesystem created afresh each time.  Must be run as root.
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/unique_fd.h>
+#include <libdm/dm.h>
+
+#include "EncryptInplace.h"
+#include "Loop.h"
+#include "Utils.h"
+#include "fs/Ext4.h"
+#include "fs/F2fs.h"
+
+using android::base::unique_fd;
+using namespace android::dm;
+using namespace std::chrono_literals;
+
+static constexpr char VERSION[] = "0";
+static constexpr char kDmName[] = "encrypt_inplace_bench";
+
+// Each set of files that the filesystem gets filled with.
+static constexpr int kFilesPerSet = 8;
+
+struct Options {
+    std::string fs_type = "ext4";
+    std::string target = "crypt";
+    std::string work_dir = "/data/local/tmp";
+    uint64_t size_mb = 1024;
+    unsigned int fill_percent = 50;
+    // If nonzero, the used blocks are fragmented into extents of about this size.
+    unsigned int fragment_kb = 0;
+    // Whether to also measure the encryption with its progress saved to a file,
+    // which is how it's always done on devices.
+    bool save_progress = true;
+};
+
+static void usage(std::ostream& ostr, const std::string& program_name) {
+    Options options;
+    ostr << "Usage: " << program_name << " [options]\n";
+    ostr << "\t-t FS_TYPE\t: ext4 or f2fs (default " << options.fs_type << ").\n";
+    ostr << "\t-d TARGET\t: Device-mapper target to encrypt through, crypt or linear (default "
+         << options.target << ").\n";
+    ostr << "\t-w DIR\t\t: Directory for the image file (default " << options.work_dir << ").\n";
+    ostr << "\t-s SIZE_MB\t: Size of the image (default " << options.size_mb << ").\n";
+    ostr << "\t-f PERCENT\t: Percentage of the filesystem to fill (default "
+         << options.fill_percent << ").\n";
+    ostr << "\t-g FRAGMENT_KB\t: Fragment the used blocks into extents of this size (default "
+         << "unfragmented).\n";
+    ostr << "\t-P\t\t: Only measure encryption without saving progress.\n";
+}
+
+static void report_metric(const std::string& metric, double value, const std::string& unit) {
+    std::cout << VERSION << ";" << metric << ";" << value << ";" << unit << std::endl;
+}
+
+// Writes |bytes| bytes in chunks of |chunk_size| to the files |fds| in turn.
+static bool write_round_robin(const std::vector<int>& fds, uint64_t bytes, size_t chunk_size) {
+    std::vector<char> buf(chunk_size);
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = rand();
+
+    for (uint64_t written = 0; written < bytes; written += chunk_size) {
+        int fd = fds[(written / chunk_size) % fds.size()];
+        if (!android::base::WriteFully(fd, buf.data(), buf.size())) {
+            PLOG(ERROR) << "Failed to fill filesystem";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fills the filesystem mounted at |mount_point| to the requested ratio.  To
+// fragment it, twice as much data is written, alternating chunks between two
+// sets of files, and then one set is deleted.
+static bool fill_filesystem(const std::string& mount_point, const Options& options) {
+    uint64_t fill_bytes = options.size_mb * 1024 * 1024 * options.fill_percent / 100;
+    bool fragment = options.fragment_kb != 0;
+    int num_sets = fragment ? 2 : 1;
+
+    std::vector<unique_fd> fds;
+    for (int i = 0; i < kFilesPerSet * num_sets; i++) {
+        std::string path = mount_point + "/file" + std::to_string(i);
+        fds.emplace_back(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        if (fds.back() < 0) {
+            PLOG(ERROR) << "Failed to create " << path;
+            return false;
+        }
+    }
+
+    // Without fragmentation, write each file in one go.
+    if (!fragment) {
+        for (const auto& fd : fds) {
+            if (!write_round_robin({fd.get()}, fill_bytes / fds.size(), 1024 * 1024)) return false;
+        }
+    } else {
+        std::vector<int> raw_fds;
+        for (const auto& fd : fds) raw_fds.push_back(fd.get());
+        if (!write_round_robin(raw_fds, fill_bytes * num_sets, options.fragment_kb * 1024))
+            return false;
+    }
+
+    for (const auto& fd : fds) {
+        if (fsync(fd) != 0) {
+            PLOG(ERROR) << "Failed to sync filesystem";
+            return false;
+        }
+    }
+    // The files are interleaved as set 0, set 1, set 0, ..., so delete the
+    // odd-numbered ones.
+    if (fragment) {
+        for (int i = 1; i < kFilesPerSet * num_sets; i += 2) {
+            unlink((mount_point + "/file" + std::to_string(i)).c_str());
+        }
+    }
+    sync();
+    return true;
+}
+
+static bool format_and_fill(const std::string& loop_device, const Options& options) {
+    std::string mount_point = options.work_dir + "/encrypt_inplace_bench.mnt";
+    if (mkdir(mount_point.c_str(), 0700) != 0 && errno != EEXIST) {
+        PLOG(ERROR) << "Failed to create " << mount_point;
+        return false;
+    }
+
+    android::status_t res;
+    if (options.fs_type == "ext4") {
+        res = android::vold::ext4::Format(loop_device, 0, mount_point);
+        if (res == android::OK)
+            res = android::vold::ext4::Mount(loop_device, mount_point, false, false, false);
+    } else {
+        res = android::vold::f2fs::Format(loop_device, false, {});
+        if (res == android::OK) res = android::vold::f2fs::Mount(loop_device, mount_point);
+    }
+    if (res != android::OK) {
+        LOG(ERROR) << "Failed to format and mount " << loop_device << " as " << options.fs_type;
+        return false;
+    }
+
+    bool success = fill_filesystem(mount_point, options);
+    if (umount2(mount_point.c_str(), 0) != 0) {
+        PLOG(ERROR) << "Failed to unmount " << mount_point;
+        success = false;
+    }
+    rmdir(mount_point.c_str());
+    return success;
+}
+
+static bool create_dm_device(const std::string& loop_device, const Options& options,
+                             uint64_t* nr_sec, std::string* dm_device) {
+    if (android::vold::GetBlockDev512Sectors(loop_device, nr_sec) != android::OK) {
+        PLOG(ERROR) << "Unable to measure size of " << loop_device;
+        return false;
+    }
+    // Like dm-default-key, use 4096-byte crypto sectors.
+    *nr_sec &= ~7;
+
+    DmTable table;
+    if (options.target == "crypt") {
+        std::string key, key_hex;
+        if (android::vold::ReadRandomBytes(64, key) != android::OK ||
+            android::vold::StrToHex(key, key_hex) != android::OK) {
+            LOG(ERROR) << "Failed to generate key";
+            return false;
+        }
+        auto target = std::make_unique<DmTargetCrypt>(0, *nr_sec, "aes-xts-plain64", key_hex, 0,
+                                                      loop_device, 0);
+        target->SetSectorSize(4096);
+        target->SetIvLargeSectors();
+        table.AddTarget(std::move(target));
+    } else {
+        table.AddTarget(std::make_unique<DmTargetLinear>(0, *nr_sec, loop_device, 0));
+    }
+
+    if (!DeviceMapper::Instance().CreateDevice(kDmName, table, dm_device, 5s)) {
+        LOG(ERROR) << "Failed to create dm-" << options.target << " device";
+        return false;
+    }
+    return true;
+}
+
+// Creates the filesystem in |image| and encrypts it, saving progress to
+// |progress_path| if it's non-empty.
+static bool run_encryption(const std::string& image, const Options& options,
+                           const std::string& progress_path, EncryptInPlaceStats* stats) {
+    if (Loop::createImageFile(image.c_str(), options.size_mb * 2048) != 0) return false;
+
+    std::string loop_device;
+    if (Loop::create(image, loop_device) != 0) return false;
+
+    bool success = false;
+    std::string dm_device;
+    uint64_t nr_sec;
+    if (format_and_fill(loop_device, options) &&
+        create_dm_device(loop_device, options, &nr_sec, &dm_device)) {
+        // Start from a cold page cache, as on first boot.
+        android::base::WriteStringToFile("3", "/proc/sys/vm/drop_caches");
+        success = encrypt_inplace(dm_device, loop_device, nr_sec, progress_path, stats);
+        DeviceMapper::Instance().DeleteDevice(kDmName);
+    }
+    Loop::destroyByDevice(loop_device.c_str());
+    unlink(image.c_str());
+    if (!progress_path.empty()) unlink(progress_path.c_str());
+    return success;
+}
+
+// Reports the metrics of one encryption, with names starting with |prefix|.
+static void report_stats(const std::string& prefix, const EncryptInPlaceStats& stats) {
+    double seconds = std::chrono::duration<double>(stats.total_time).count();
+    double io_seconds = std::chrono::duration<double>(stats.io_wait_time).count();
+    double gib = stats.bytes_encrypted / (1024.0 * 1024.0 * 1024.0);
+    report_metric(prefix + "bytes_encrypted", stats.bytes_encrypted, "B");
+    report_metric(prefix + "throughput", stats.bytes_encrypted / (1024.0 * 1024.0) / seconds,
+                  "MiB/s");
+    report_metric(prefix + "syscalls_per_gib", (stats.read_calls + stats.write_calls) / gib,
+                  "calls");
+    report_metric(prefix + "total_time", seconds * 1000, "ms");
+    report_metric(prefix + "io_wait_time", io_seconds * 1000, "ms");
+    report_metric(prefix + "scan_time", std::max(0.0, seconds - io_seconds) * 1000, "ms");
+}
+
+static bool run_benchmark(const std::string& image, const Options& options) {
+    EncryptInPlaceStats stats;
+    if (!run_encryption(image, options, "", &stats)) {
+        LOG(ERROR) << "Benchmark failed";
+        return false;
+    }
+    report_stats("", stats);
+
+    if (!options.save_progress) return true;
+    std::string progress_path = options.work_dir + "/encrypt_inplace_bench.progress";
+    if (!run_encryption(image, options, progress_path, &stats)) {
+        LOG(ERROR) << "Benchmark with saved progress failed";
+        return false;
+    }
+    report_stats("progress_", stats);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    android::base::InitLogging(argv, android::base::StderrLogger);
+
+    Options options;
+    int c;
+    while ((c = getopt(argc, argv, "t:d:w:s:f:g:Ph")) != -1) {
+        bool ok = true;
+        switch (c) {
+            case 't':
+                options.fs_type = optarg;
+                ok = options.fs_type == "ext4" || options.fs_type == "f2fs";
+                break;
+            case 'd':
+                options.target = optarg;
+                ok = options.target == "crypt" || options.target == "linear";
+                break;
+            case 'w':
+                options.work_dir = optarg;
+                break;
+            case 's':
+                ok = android::base::ParseUint(optarg, &options.size_mb, uint64_t(1024 * 1024)) &&
+                     options.size_mb > 0;
+                break;
+            case 'f':
+                ok = android::base::ParseUint(optarg, &options.fill_percent, 90u);
+                break;
+            case 'g':
+                ok = android::base::ParseUint(optarg, &options.fragment_kb, 1024u * 1024) &&
+                     options.fragment_kb % 4 == 0;
+                break;
+            case 'P':
+                options.save_progress = false;
+                break;
+            case 'h':
+                usage(std::cout, argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            usage(std::cerr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Fragmenting writes twice the data before deleting half of it.
+    if (options.fragment_kb != 0 && options.fill_percent > 45) {
+        std::cerr << "With -g, the fill percentage can be at most 45" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string image = options.work_dir + "/encrypt_inplace_bench.img";
+    bool success = run_benchmark(image, options);
+    unlink(image.c_str());
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -17,6 +17,7 @@
 #define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
 
 #include "FsCrypt.h"
+#include "IdleMaint.h"
 #include "MetadataCrypt.h"
 #include "NetlinkManager.h"
 #include "VoldNativeService.h"
@@ -131,6 +132,8 @@ int main(int argc, char** argv) {
 
     LOG(DEBUG) << "VoldNativeService::start() completed OK";
 
+    android::vold::StartStorageTelemetry();
+
     ATRACE_BEGIN("NetlinkManager::start");
     if (nm->start()) {
         PLOG(ERROR) << "Unable to start NetlinkManager";
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../Crc32.h"
+
+namespace android {
+namespace vold {
+
+class Crc32Test : public testing::Test {};
+
+static const Crc32Impl kAllImpls[] = {Crc32Impl::kBytewise, Crc32Impl::kSlicingBy8,
+                                      Crc32Impl::kArmv8, Crc32Impl::kPclmul};
+
+static std::vector<uint8_t> RandomBytes(size_t n) {
+    std::vector<uint8_t> data(n);
+    for (auto& b : data) b = rand();
+    return data;
+}
+
+TEST_F(Crc32Test, KnownValues) {
+    // No inversion, so the empty string leaves the CRC alone and zero bytes
+    // leave a zero CRC alone.
+    EXPECT_EQ(0u, Crc32(0, "", 0));
+    EXPECT_EQ(0x12345678u, Crc32(0x12345678, "", 0));
+    std::vector<uint8_t> zeroes(4096);
+    EXPECT_EQ(0u, Crc32(0, zeroes.data(), zeroes.size()));
+
+    // The standard check value of CRC-32 is 0xCBF43926, with inversion.
+    EXPECT_EQ(0xCBF43926u, ~Crc32(~0u, "123456789", 9));
+}
+
+TEST_F(Crc32Test, MatchesBytewise) {
+    srand(0);
+    for (auto impl : kAllImpls) {
+        if (!Crc32ImplSupported(impl)) continue;
+        SCOPED_TRACE(static_cast<int>(impl));
+        // Cover all the lengths around the block sizes, at all alignments.
+        for (size_t len = 0; len < 300; len++) {
+            auto data = RandomBytes(len + 16);
+            uint32_t crc = rand();
+            for (size_t offset = 0; offset < 16; offset++) {
+                ASSERT_EQ(Crc32With(Crc32Impl::kBytewise, crc, &data[offset], len),
+                          Crc32With(impl, crc, &data[offset], len))
+                        << "len " << len << " offset " << offset;
+            }
+        }
+        for (size_t len : {4096, 65536, 65536 + 13}) {
+            auto data = RandomBytes(len);
+            uint32_t crc = rand();
+            ASSERT_EQ(Crc32With(Crc32Impl::kBytewise, crc, data.data(), len),
+                      Crc32With(impl, crc, data.data(), len));
+        }
+    }
+}
+
+TEST_F(Crc32Test, Chaining) {
+    srand(1);
+    auto data = RandomBytes(8192);
+    uint32_t crc = 42;
+    for (size_t i = 0; i < data.size(); i += 4096) crc = Crc32(crc, &data[i], 4096);
+    EXPECT_EQ(Crc32With(Crc32Impl::kBytewise, 42, data.data(), data.size()), crc);
+}
+
+TEST_F(Crc32Test, SupportedImpls) {
+    EXPECT_TRUE(Crc32ImplSupported(Crc32Impl::kBytewise));
+    EXPECT_TRUE(Crc32ImplSupported(Crc32Impl::kSlicingBy8));
+}
+
+}  // namespace vold
+}  // namespace android
@@ -29,6 +29,7 @@
 #include <sys/un.h>
 
 #include "Utils.h"
+#include "android/os/BnVoldTaskListener.h"
 #include "android/os/IVold.h"
 
 #include <android-base/logging.h>
@@ -37,6 +38,7 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <binder/IServiceManager.h>
+#include <binder/ProcessState.h>
 #include <binder/Status.h>
 #include <utils/Errors.h>
 
@@ -100,6 +102,33 @@ static void mountFstab(std::vector<std::string>& args,
                                  userDevices));
 }
 
+// Logs the progress of in-place encryption, which can take many minutes on
+// first boot.  Only whole-percent changes are logged, to keep kmsg readable.
+class EncryptProgressListener : public android::os::BnVoldTaskListener {
+  public:
+    android::binder::Status onStatus(int status,
+                                     const android::os::PersistableBundle& extras) override {
+        if (status == last_percent_) return android::binder::Status::ok();
+        last_percent_ = status;
+
+        int64_t bytes_per_sec = 0, eta_sec = -1;
+        extras.getLong(android::String16("bytes_per_sec"), &bytes_per_sec);
+        extras.getLong(android::String16("eta_sec"), &eta_sec);
+        LOG(INFO) << "Encrypted " << status << "% (" << bytes_per_sec / (1024 * 1024)
+                  << " MiB/s, "
+                  << (eta_sec >= 0 ? std::to_string(eta_sec) + "s" : std::string("unknown"))
+                  << " remaining)";
+        return android::binder::Status::ok();
+    }
+
+    android::binder::Status onFinished(int, const android::os::PersistableBundle&) override {
+        return android::binder::Status::ok();
+    }
+
+  private:
+    int last_percent_ = -1;
+};
+
 static void encryptFstab(std::vector<std::string>& args,
                          const android::sp<android::os::IVold>& vold) {
     auto shouldFormat = android::base::ParseBool(args[4]);
@@ -112,10 +141,14 @@ static void encryptFstab(std::vector<std::string>& args,
     if (args[7] != "") {
         userDevices = android::base::Split(args[7], " ");
     }
+    // The progress callbacks arrive on the binder thread pool.
+    android::ProcessState::self()->startThreadPool();
+    android::sp<EncryptProgressListener> listener = new EncryptProgressListener();
     checkStatus(args,
                 vold->encryptFstab(args[2], args[3],
                                    shouldFormat == android::base::ParseBoolResult::kTrue, args[5],
-                                   isZoned == android::base::ParseBoolResult::kTrue, userDevices));
+                                   isZoned == android::base::ParseBoolResult::kTrue, userDevices,
+                                   listener));
 }
 
 int main(int argc, char** argv) {